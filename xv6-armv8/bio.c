@@ -1,143 +1,701 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
-// cached copies of disk block contents.  Caching disk blocks
-// in memory reduces the number of disk reads and also provides
-// a synchronization point for disk blocks used by multiple processes.
+// The buffer cache is a set of buf structures holding cached copies
+// of disk block contents.  Caching disk blocks in memory reduces the
+// number of disk reads and also provides a synchronization point for
+// disk blocks used by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bdwrite to have it written back later (delayed write).
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
 //
+// A buffer returned from bread is locked with its sleep lock until
+// it is passed back to brelse. refcnt counts the processes that
+// hold or wait for the lock; a buffer is only recycled when it is 0.
+//
 // The implementation uses three state flags internally:
-// * B_BUSY: the block has been returned from bread
-//     and has not been passed back to brelse.
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_LOGGED: the buffer holds data of a transaction that has not
+//     been committed yet (see log.c). It must stay in the cache
+//     and must not be written to its home location.
+//
+// Delayed writes are written back by a kernel thread, the flusher,
+// once they have been dirty for BFLUSH_AGE ticks, or earlier when
+// too much of the cache is dirty or no clean buffer is left to be
+// recycled. It writes them in batches sorted by sector (see iderwq).
+//
+// The cache is sized at boot to a share of the free memory. Buffers
+// are found through a hash table keyed by (dev, sector); each bucket
+// has its own lock, which protects the chain of the bucket and the
+// reference counts of the buffers on it. bcache.lock protects the LRU list and
+// serializes the recycling of buffers, which moves a buffer from one
+// bucket to another. It is always acquired before a bucket lock.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "buf.h"
+#include "fs.h"
+
+#define BCACHE_SHARE    64  // the cache takes 1/BCACHE_SHARE of free memory
+#define BCHUNK_ORD      16  // buffers are allocated 64KB at a time
+#define BDIRTY_RATIO    4   // flush early when 1/BDIRTY_RATIO of the cache is dirty
+#define BFLUSH_AGE      (3 * HZ)    // write back buffers dirty for this long
+#define BFLUSH_BATCH    32  // buffers per batch written
+
+struct bucket {
+    struct spinlock lock;
+    struct buf      *head;  // chain of buffers through hnext
+};
 
 struct {
     struct spinlock lock;
-    struct buf buf[NBUF];
+    int nbuf;
+    int wanted;     // someone is waiting for a free buffer
+    int ndirty;     // number of B_DIRTY buffers
+    int kicked;     // the flusher has been asked to run
+    struct proc *flusher;
+
+    struct bucket *bucket;
+    uint nbucket;   // a power of 2
 
     // Linked list of all buffers, through prev/next.
     // head.next is most recently used.
     struct buf head;
 } bcache;
 
+static struct bucket* bhash (uint dev, uint sector)
+{
+    return &bcache.bucket[(sector ^ (dev << 16)) & (bcache.nbucket - 1)];
+}
+
+static void bunlock (struct buf *b, int mru);
+
 void binit (void)
 {
     struct buf *b;
+    uint i, n, per_chunk;
 
     initlock(&bcache.lock, "bcache");
 
+    n = kmem_avail() / BCACHE_SHARE / (sizeof(struct buf) + BSIZE);
+
+    if (n < NBUF) {
+        n = NBUF;
+    }
+
+    // about four buffers per bucket, as many buckets as fit in a chunk
+    bcache.nbucket = 1;
+
+    while ((bcache.nbucket * 2 <= n / 4) &&
+           (bcache.nbucket * 2 * sizeof(struct bucket) <= (1 << BCHUNK_ORD))) {
+        bcache.nbucket *= 2;
+    }
+
+    if ((bcache.bucket = kmalloc(get_order(bcache.nbucket * sizeof(struct bucket)))) == NULL) {
+        panic("binit: no memory for hash table");
+    }
+
+    for (i = 0; i < bcache.nbucket; i++) {
+        initlock(&bcache.bucket[i].lock, "bcache.bucket");
+        bcache.bucket[i].head = NULL;
+    }
+
     //PAGEBREAK!
     // Create linked list of buffers
     bcache.head.prev = &bcache.head;
     bcache.head.next = &bcache.head;
 
-    for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
+    per_chunk = (1 << BCHUNK_ORD) / sizeof(struct buf);
+    i = 0;
+
+    for (bcache.nbuf = 0; bcache.nbuf < n; bcache.nbuf++) {
+        if (i == 0) {
+            if ((b = kmalloc(BCHUNK_ORD)) == NULL) {
+                break;
+            }
+
+            i = per_chunk;
+        }
+
+        memset(b, 0, sizeof(*b));
+
+        // block-sized, so a 4KB block is a page
+        if ((b->mem = kmalloc(get_order(BSIZE))) == NULL) {
+            break;
+        }
+
+        b->data = b->mem;
+
+        b->dev = -1;
+        initsleeplock(&b->lock, "buffer");
+
         b->next = bcache.head.next;
         b->prev = &bcache.head;
-        b->dev = -1;
         bcache.head.next->prev = b;
         bcache.head.next = b;
+
+        b->hnext = bhash(b->dev, b->sector)->head;
+        bhash(b->dev, b->sector)->head = b;
+
+        b++;
+        i--;
+    }
+
+    if (bcache.nbuf < NBUF) {
+        panic("binit: no memory for buffers");
+    }
+
+    cprintf("bcache: %d buffers, %d buckets\n", bcache.nbuf, bcache.nbucket);
+}
+
+// Find the buffer of sector in bucket bk, which must be locked.
+static struct buf* bfind (struct bucket *bk, uint dev, uint sector)
+{
+    struct buf *b;
+
+    for (b = bk->head; b != NULL; b = b->hnext) {
+        if (b->dev == dev && b->sector == sector) {
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+// Remove b from the chain of bucket bk, which must be locked.
+static void bunhash (struct bucket *bk, struct buf *b)
+{
+    struct buf **pp;
+
+    for (pp = &bk->head; *pp != b; pp = &(*pp)->hnext) {
+        if (*pp == NULL) {
+            panic("bunhash");
+        }
+    }
+
+    *pp = b->hnext;
+}
+
+// Wake up the flusher. Caller must hold bcache.lock.
+static void bkick (void)
+{
+    bcache.kicked = 1;
+
+    if (bcache.flusher != NULL) {
+        wakeproc(bcache.flusher, &ticks);
     }
 }
 
 // Look through buffer cache for sector on device dev.
 // If not found, allocate fresh block.
-// In either case, return B_BUSY buffer.
+// In either case, return locked buffer.
 static struct buf* bget (uint dev, uint sector)
 {
-    struct buf *b;
+    struct bucket *bk, *vk;
+    struct buf *b, *w;
 
-    acquire(&bcache.lock);
+    bk = bhash(dev, sector);
+
+    acquire(&bk->lock);
 
     loop:
     // Is the sector already cached?
-    for (b = bcache.head.next; b != &bcache.head; b = b->next) {
-        if (b->dev == dev && b->sector == sector) {
-            if (!(b->flags & B_BUSY)) {
-                b->flags |= B_BUSY;
-                release(&bcache.lock);
-                return b;
-            }
+    if ((b = bfind(bk, dev, sector)) != NULL) {
+        b->refcnt++;
+        release(&bk->lock);
+        acquiresleep(&b->lock);
+        idewait(b);  // a read started by breadahead
+        return b;
+    }
 
-            sleep(b, &bcache.lock);
-            goto loop;
-        }
+    // Not cached. Take the LRU lock and look again, someone may
+    // have brought the sector in while no lock was held.
+    release(&bk->lock);
+    acquire(&bcache.lock);
+    acquire(&bk->lock);
+
+    if (bfind(bk, dev, sector) != NULL) {
+        release(&bcache.lock);
+        goto loop;
     }
 
-    // Not cached; recycle some non-busy and clean buffer.
+    // Recycle the least recently used buffer that is not in use, and
+    // not dirty, pinned by the log or still being read.
+    w = NULL;
+
     for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-        if ((b->flags & B_BUSY) == 0 && (b->flags & B_DIRTY) == 0) {
+        vk = bhash(b->dev, b->sector);
+
+        if (vk != bk) {
+            acquire(&vk->lock);
+        }
+
+        if ((b->refcnt == 0) && !(b->flags & (B_DIRTY | B_LOGGED | B_DISK))) {
+            bunhash(vk, b);
+
+            if (vk != bk) {
+                release(&vk->lock);
+            }
+
             b->dev = dev;
             b->sector = sector;
-            b->flags = B_BUSY;
+            b->flags = 0;
+            b->data = b->mem;
+            b->refcnt = 1;
+            b->hnext = bk->head;
+            bk->head = b;
+
+            release(&bk->lock);
             release(&bcache.lock);
+            acquiresleep(&b->lock);
             return b;
         }
+
+        if ((b->refcnt == 0) && ((b->flags & (B_DIRTY | B_LOGGED | B_DISK)) == B_DISK)) {
+            w = b;
+        }
+
+        if (vk != bk) {
+            release(&vk->lock);
+        }
     }
 
-    panic("bget: no buffers");
+    // None is free, but one is only being read (see breadahead):
+    // wait for the read to end, nothing else would wake us.
+    if (w != NULL) {
+        vk = bhash(w->dev, w->sector);
+
+        if (vk != bk) {
+            acquire(&vk->lock);
+        }
+
+        w->refcnt++;
+
+        if (vk != bk) {
+            release(&vk->lock);
+        }
+
+        release(&bk->lock);
+        release(&bcache.lock);
+
+        acquiresleep(&w->lock);
+        idewait(w);
+        bunlock(w, 0);
+
+        acquire(&bk->lock);
+        goto loop;
+    }
+
+    // All the buffers are in use or dirty. Have the dirty ones
+    // written back, and wait for one to be released.
+    release(&bk->lock);
+    bkick();
+    bcache.wanted = 1;
+    sleep(&bcache, &bcache.lock);
+    release(&bcache.lock);
+
+    acquire(&bk->lock);
+    goto loop;
 }
 
-// Return a B_BUSY buf with the contents of the indicated disk sector.
+// Return a locked buf with the contents of the indicated disk sector.
+// If the disk keeps the sector in memory, the buf uses that memory
+// in place, with nothing copied (B_ALIAS); a caller that changes
+// the data must call bmodify first.
 struct buf* bread (uint dev, uint sector)
 {
     struct buf *b;
+    uchar *p;
 
     b = bget(dev, sector);
 
     if (!(b->flags & B_VALID)) {
-        iderw(b);
+        if ((p = ideaddr(dev, sector)) != 0) {
+            b->data = p;
+            b->flags |= B_VALID | B_ALIAS;
+        } else {
+            iderw(b);
+        }
     }
 
     return b;
 }
 
-// Write b's contents to disk.  Must be B_BUSY.
+// Give b data of its own, a copy of the disk's, before the caller
+// changes it (copy on write). b must be locked.
+void bmodify (struct buf *b)
+{
+    if (b->flags & B_ALIAS) {
+        memmove(b->mem, b->data, BSIZE);
+        b->data = b->mem;
+        b->flags &= ~B_ALIAS;
+    }
+}
+
+// Return a locked buf for the indicated disk sector, for a caller
+// that overwrites all of its data: it is not read from disk.
+struct buf* bnew (uint dev, uint sector)
+{
+    struct buf *b;
+
+    b = bget(dev, sector);
+    b->data = b->mem;
+    b->flags = (b->flags & ~B_ALIAS) | B_VALID;
+
+    return b;
+}
+
+// Does the cache hold changes to sector that are not on disk yet?
+int bpending (uint dev, uint sector)
+{
+    struct bucket *bk;
+    struct buf *b;
+    int r;
+
+    bk = bhash(dev, sector);
+
+    acquire(&bk->lock);
+    b = bfind(bk, dev, sector);
+    r = (b != NULL) && (b->flags & (B_DIRTY | B_LOGGED));
+    release(&bk->lock);
+
+    return r;
+}
+
+// Bring sector into the cache for a later bread, without keeping
+// the buffer. The memory disk completes the read at once; with an
+// interrupt-driven disk, this only has to start it: the buffer is
+// released with the read in flight (B_DISK), and bget waits for
+// the read when the buffer is wanted again.
+void breadahead (uint dev, uint sector)
+{
+    struct buf *b;
+
+    if (ideaddr(dev, sector) != 0) {
+        return;  // bread won't have to read it
+    }
+
+    b = bget(dev, sector);
+
+    if (!(b->flags & B_VALID)) {
+        idestart(b);
+    }
+
+    brelse(b);
+}
+
+// Copy the data of sector into dst, BSIZE bytes. If the sector is
+// not cached, read it from disk straight into dst without caching
+// it: this is for file data, which the page cache keeps.
+void breadto (uint dev, uint sector, uchar *dst)
+{
+    struct bucket *bk;
+    struct buf *b, tmp;
+
+    bk = bhash(dev, sector);
+
+    acquire(&bk->lock);
+    b = bfind(bk, dev, sector);
+    release(&bk->lock);
+
+    if (b != NULL) {
+        b = bread(dev, sector);
+        memmove(dst, b->data, BSIZE);
+        brelse(b);
+        return;
+    }
+
+    memset(&tmp, 0, sizeof(tmp));
+    initsleeplock(&tmp.lock, "breadto");
+    acquiresleep(&tmp.lock);
+
+    tmp.dev = dev;
+    tmp.sector = sector;
+    tmp.data = dst;
+    iderw(&tmp);
+
+    releasesleep(&tmp.lock);
+}
+
+// Copy the data of the n sectors in sector[] into dst[], BSIZE bytes
+// each, like breadto, but with the reads of the sectors that are not
+// cached in flight together.
+void breadtov (uint dev, uint *sector, uchar **dst, int n)
+{
+    struct bucket *bk;
+    struct buf *b, *tmp, *q;
+    int i, order;
+
+    order = get_order(n * sizeof(*tmp));
+
+    if ((n <= 1) || ((tmp = kmalloc(order)) == NULL)) {
+        for (i = 0; i < n; i++) {
+            breadto(dev, sector[i], dst[i]);
+        }
+
+        return;
+    }
+
+    q = NULL;
+
+    for (i = n - 1; i >= 0; i--) {
+        bk = bhash(dev, sector[i]);
+
+        acquire(&bk->lock);
+        b = bfind(bk, dev, sector[i]);
+        release(&bk->lock);
+
+        if (b != NULL) {
+            breadto(dev, sector[i], dst[i]);
+            continue;
+        }
+
+        b = &tmp[i];
+        memset(b, 0, sizeof(*b));
+        initsleeplock(&b->lock, "breadto");
+        acquiresleep(&b->lock);
+
+        b->dev = dev;
+        b->sector = sector[i];
+        b->data = dst[i];
+        b->qnext = q;
+        q = b;
+    }
+
+    if (q != NULL) {
+        iderwq(q);
+    }
+
+    for (b = q; b != NULL; b = b->qnext) {
+        releasesleep(&b->lock);
+    }
+
+    kfree(tmp, order);
+}
+
+// Write n locked buffers to disk, as one batch sorted by sector.
+void bwritev (struct buf **bp, int n)
+{
+    struct buf *q, **pp;
+    int i, ndirty;
+
+    q = NULL;
+    ndirty = 0;
+
+    for (i = 0; i < n; i++) {
+        if (!holdingsleep(&bp[i]->lock)) {
+            panic("bwritev");
+        }
+
+        if (bp[i]->flags & B_DIRTY) {
+            ndirty++;
+        }
+
+        bp[i]->flags |= B_DIRTY;
+
+        for (pp = &q; (*pp != NULL) && ((*pp)->sector < bp[i]->sector); pp = &(*pp)->qnext)
+            ;
+
+        bp[i]->qnext = *pp;
+        *pp = bp[i];
+    }
+
+    iderwq(q);
+
+    if (ndirty > 0) {
+        acquire(&bcache.lock);
+        bcache.ndirty -= ndirty;
+        release(&bcache.lock);
+    }
+}
+
+// Write b's contents to disk.  Must be locked.
 void bwrite (struct buf *b)
 {
-    if ((b->flags & B_BUSY) == 0) {
-        panic("bwrite");
+    bwritev(&b, 1);
+}
+
+// Mark b dirty, to be written back later by the flusher.
+// Must be locked.
+void bdwrite (struct buf *b)
+{
+    if (!holdingsleep(&b->lock)) {
+        panic("bdwrite");
+    }
+
+    acquire(&bcache.lock);
+
+    if (!(b->flags & B_DIRTY)) {
+        b->flags |= B_DIRTY;
+        b->dirtied = ticks;
+        bcache.ndirty++;
+
+        if (bcache.ndirty > bcache.nbuf / BDIRTY_RATIO) {
+            bkick();
+        }
+    }
+
+    release(&bcache.lock);
+}
+
+// Unlock a buffer and drop the reference to it. If mru is set,
+// move it to the head of the MRU list.
+static void bunlock (struct buf *b, int mru)
+{
+    struct bucket *bk;
+
+    releasesleep(&b->lock);
+
+    bk = bhash(b->dev, b->sector);
+
+    acquire(&bcache.lock);
+    acquire(&bk->lock);
+
+    if (mru) {
+        b->next->prev = b->prev;
+        b->prev->next = b->next;
+        b->next = bcache.head.next;
+        b->prev = &bcache.head;
+        bcache.head.next->prev = b;
+        bcache.head.next = b;
+    }
+
+    b->refcnt--;
+    release(&bk->lock);
+
+    if (bcache.wanted) {
+        bcache.wanted = 0;
+        wakeup(&bcache);
     }
 
-    b->flags |= B_DIRTY;
-    iderw(b);
+    release(&bcache.lock);
 }
 
-// Release a B_BUSY buffer.
+// Release a locked buffer.
 // Move to the head of the MRU list.
 void brelse (struct buf *b)
 {
-    if ((b->flags & B_BUSY) == 0) {
+    if (!holdingsleep(&b->lock)) {
         panic("brelse");
     }
 
+    bunlock(b, 1);
+}
+
+//PAGEBREAK!
+// Write back a batch of dirty buffers, oldest first. Buffers pinned
+// by the log are left alone. If all is set, write any dirty buffer,
+// waiting for those in use. Otherwise only take buffers that are not
+// in use and have been dirty for BFLUSH_AGE ticks, or any of them if
+// too much of the cache is dirty. Return the number written.
+static int bflush (int all)
+{
+    struct buf *bp[BFLUSH_BATCH], *b;
+    struct bucket *bk;
+    int i, n, nw, early;
+
+    n = 0;
+
     acquire(&bcache.lock);
+    early = all || (bcache.ndirty > bcache.nbuf / BDIRTY_RATIO);
 
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    for (b = bcache.head.prev; (b != &bcache.head) && (n < BFLUSH_BATCH); b = b->prev) {
+        if ((b->flags & (B_DIRTY | B_LOGGED)) != B_DIRTY) {
+            continue;
+        }
 
-    b->flags &= ~B_BUSY;
-    wakeup(b);
+        if (!early && (ticks - b->dirtied < BFLUSH_AGE)) {
+            continue;
+        }
+
+        bk = bhash(b->dev, b->sector);
+        acquire(&bk->lock);
+
+        if (all || (b->refcnt == 0)) {
+            b->refcnt++;
+            bp[n++] = b;
+        }
+
+        release(&bk->lock);
+    }
 
     release(&bcache.lock);
+
+    // lock them, and check again: a buffer may have been
+    // written or pinned by the log in the meantime
+    nw = 0;
+
+    for (i = 0; i < n; i++) {
+        b = bp[i];
+        acquiresleep(&b->lock);
+
+        if ((b->flags & (B_DIRTY | B_LOGGED)) == B_DIRTY) {
+            bp[i] = bp[nw];
+            bp[nw++] = b;
+        }
+    }
+
+    if (nw > 0) {
+        bwritev(bp, nw);
+    }
+
+    // keep their place in the LRU list, clean buffers are
+    // good candidates for recycling
+    for (i = 0; i < n; i++) {
+        bunlock(bp[i], 0);
+    }
+
+    return nw;
 }
 
+// Write all dirty buffers that are not pinned by the log to disk.
+void bsync (void)
+{
+    while (bflush(1) > 0)
+        ;
+}
+
+// The flusher kernel thread. It wakes up every tick (or when it
+// is kicked), but only looks for work every HZ ticks. It also
+// commits a log transaction that has been open for too long,
+// whether or not there are dirty buffers: the blocks of an open
+// transaction are pinned (B_LOGGED), not dirty.
+static void bflusher (void)
+{
+    uint last;
+
+    last = ticks;
+
+    for (;;) {
+        acquire(&bcache.lock);
+
+        while (!bcache.kicked && (ticks - last < HZ)) {
+            sleep(&ticks, &bcache.lock);
+        }
+
+        bcache.kicked = 0;
+        last = ticks;
+        release(&bcache.lock);
+
+        log_age();
+
+        while (bflush(0) > 0)
+            ;
+    }
+}
+
+// Start the flusher. Called in the context of the first process.
+void bflushinit (void)
+{
+    bcache.flusher = kthread("bflush", bflusher);
+}
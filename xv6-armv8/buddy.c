@@ -13,22 +13,28 @@
 // allocation status for each block. This allows for efficient merging
 // when blocks are freed. We also use double-linked list to chain together
 // free blocks (for each order), thus allowing fast allocation. There is
-// about 8% overhead (maximum) for this structure.
-
-#define MAX_ORD      12
+// about 1.6% overhead (maximum) for this structure: a 16-byte mark for
+// every 32 blocks of an order, which is 16 bytes per 2KB for the
+// smallest order, and as much again for all the larger ones.
+//
+// Blocks larger than a page (up to MAX_ORD) are only available as long
+// as user pages do not fragment the memory. kmalloc compacts memory (see
+// kmem_compact) when such a request cannot be satisfied.
+
+#define MAX_ORD      16
 #define MIN_ORD      6
 #define N_ORD        (MAX_ORD - MIN_ORD +1)
 
 struct mark {
-    uint32  lnks;       // double links (actually indexes) 
+    uint64  lnks;       // double links (actually indexes) 
     uint32  bitmap;     // bitmap, whether the block is available (1=available)
 };
 
 // lnks is a combination of previous link (index) and next link (index)
-#define PRE_LNK(lnks)   ((lnks) >> 16)
-#define NEXT_LNK(lnks)  ((lnks) & 0xFFFF)
-#define LNKS(pre, next) (((pre) << 16) | ((next) & 0xFFFF))
-#define NIL             ((uint16)0xFFFF)
+#define PRE_LNK(lnks)   ((uint32)((lnks) >> 32))
+#define NEXT_LNK(lnks)  ((uint32)(lnks))
+#define LNKS(pre, next) (((uint64)(pre) << 32) | (uint32)(next))
+#define NIL             ((uint32)0xFFFFFFFF)
 
 struct order {
     uint32  head;       // the first non-empty mark
@@ -41,6 +47,8 @@ struct kmem {
     uint64            start_heap;        // start of allocatable memory
     uint64            end;
     struct order    orders[N_ORD];  // orders used for buddy systems
+    uint            ncompact;       // blocks freed by compaction
+    uint            nmoved;         // user pages moved to free them
 };
 
 static struct kmem kmem;
@@ -116,7 +124,7 @@ static void unmark_blk (int order, int blk_id)
 {
     struct mark     *mk, *p;
     struct order    *ord;
-    int             prev, next;
+    uint32          prev, next;
 
     ord = &kmem.orders[order - MIN_ORD];
     mk  = get_mark (order, blk_id >> 5);
@@ -254,6 +262,13 @@ void *kmalloc (int order)
     up = _kmalloc(order);
     release(&kmem.lock);
 
+    // multi-page blocks can be recovered by moving user pages away
+    if ((up == NULL) && (order > PTE_SHIFT) && (kmem_compact(order) == 0)) {
+        acquire(&kmem.lock);
+        up = _kmalloc(order);
+        release(&kmem.lock);
+    }
+
     return up;
 }
 
@@ -305,6 +320,167 @@ void* alloc_page (void)
     return kmalloc (PTE_SHIFT);
 }
 
+//PAGEBREAK!
+// Compaction. A free block of a high order only exists if all the
+// smaller blocks in it are free. User pages are movable: kmem_compact
+// looks for a region of the requested order whose used memory is made
+// only of user pages, migrates those pages out of the region (their
+// PTEs are rewritten by move_upages in vm.c) and lets the freed pages
+// merge back into a single block.
+
+// number of free bytes in a block, counting its free sub-blocks
+static uint64 free_bytes (int order, int blk_id)
+{
+    if (available(get_mark(order, blk_id >> 5)->bitmap, blk_id)) {
+        return 1 << order;
+    }
+
+    if (order == MIN_ORD) {
+        return 0;
+    }
+
+    return free_bytes(order - 1, blk_id << 1) + free_bytes(order - 1, (blk_id << 1) + 1);
+}
+
+// Allocate a page outside of [lo, hi) (kernel virtual addresses).
+// Pages that fall inside the range are chained on *held, the caller
+// must release them with kmem_release_held.
+void* alloc_page_outside (uint64 lo, uint64 hi, void **held)
+{
+    void *mem;
+
+    while ((mem = alloc_page()) != NULL) {
+        if (((uint64)mem < lo) || ((uint64)mem >= hi)) {
+            break;
+        }
+
+        *(void**)mem = *held;
+        *held = mem;
+    }
+
+    return mem;
+}
+
+void kmem_release_held (void *held)
+{
+    void *next;
+
+    for (; held != NULL; held = next) {
+        next = *(void**)held;
+        free_page(held);
+    }
+}
+
+// Try to produce a free block of the given order. Return 0 if such a
+// block exists afterwards, -1 otherwise.
+int kmem_compact (int order)
+{
+    int blk_id, nblk, moved;
+    uint64 lo, used, size;
+    void *held;
+
+    if ((order > MAX_ORD) || (order <= PTE_SHIFT)) {
+        return -1;
+    }
+
+    size = 1 << order;
+    nblk = (kmem.end - kmem.start_heap) >> order;
+
+    for (blk_id = 0; blk_id < nblk; blk_id++) {
+        lo = (uint64)blkid2mem(order, blk_id);
+
+        acquire(&kmem.lock);
+        used = size - free_bytes(order, blk_id);
+        release(&kmem.lock);
+
+        // do not bother with regions that are mostly in use
+        if ((used == 0) || (used > size / 2)) {
+            continue;
+        }
+
+        // everything in use must be movable user pages
+        if (move_upages(v2p((void*)lo), v2p((void*)lo) + size, NULL) * PTE_SZ != used) {
+            continue;
+        }
+
+        held = NULL;
+        moved = move_upages(v2p((void*)lo), v2p((void*)lo) + size, &held);
+        kmem_release_held(held);
+
+        acquire(&kmem.lock);
+        used = size - free_bytes(order, blk_id);
+        release(&kmem.lock);
+
+        if (used == 0) {
+            acquire(&kmem.lock);
+            kmem.ncompact++;
+            kmem.nmoved += moved;
+            release(&kmem.lock);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// number of free blocks of an order, used to show fragmentation
+int kmem_nfree (int order)
+{
+    struct mark *mk;
+    uint32 idx;
+    int i, n;
+
+    if ((order > MAX_ORD) || (order < MIN_ORD)) {
+        return 0;
+    }
+
+    n = 0;
+    acquire(&kmem.lock);
+
+    for (idx = kmem.orders[order - MIN_ORD].head; idx != NIL; idx = NEXT_LNK(mk->lnks)) {
+        mk = get_mark(order, idx);
+
+        for (i = 0; i < 32; i++) {
+            if (mk->bitmap & (1 << i)) {
+                n++;
+            }
+        }
+    }
+
+    release(&kmem.lock);
+    return n;
+}
+
+// total size of the free memory in bytes
+uint64 kmem_avail (void)
+{
+    uint64 n;
+    int order;
+
+    n = 0;
+
+    for (order = MIN_ORD; order <= MAX_ORD; order++) {
+        n += (uint64) kmem_nfree(order) << order;
+    }
+
+    return n;
+}
+
+// print the free block counts of all orders, for debugging.
+// Runs when user types ^F on console.
+void kmemdump (void)
+{
+    int order;
+
+    cprintf("free blocks:");
+
+    for (order = MIN_ORD; order <= MAX_ORD; order++) {
+        cprintf(" %d:%d", order, kmem_nfree(order));
+    }
+
+    cprintf("\ncompacted: %d blocks, %d pages moved\n", kmem.ncompact, kmem.nmoved);
+}
+
 // round up power of 2, then get the order
 //   http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
 int get_order (uint32 v)
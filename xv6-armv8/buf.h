@@ -4,15 +4,22 @@
 struct buf {
     int        flags;
     uint       dev;
-    uint       sector;
+    uint       sector;  // block number, in BSIZE blocks
+    struct sleeplock lock;
+    uint       refcnt;
+    uint       dirtied; // ticks when B_DIRTY was set by bdwrite
     struct buf *prev;  // LRU cache list
     struct buf *next;
+    struct buf *hnext; // hash chain
     struct buf *qnext; // disk queue
-    uchar      data[512];
+    uchar      *data;   // BSIZE bytes: mem, or the disk's own (B_ALIAS)
+    uchar      *mem;    // the buffer's own BSIZE bytes
 };
 
-#define B_BUSY  0x1  // buffer is locked by some process
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_LOGGED 0x8 // buffer is part of an uncommitted transaction
+#define B_ALIAS 0x10 // data is the memory of the disk itself, read-only
+#define B_DISK  0x20 // a disk request for the buffer is in flight
 
 #endif
@@ -6,6 +6,7 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
 #include "memlayout.h"
@@ -157,6 +158,7 @@ void consputc (int c)
 }
 
 #define INPUT_BUF 512
+#define CONSCOPY 128  // bytes moved to or from user memory at once
 struct {
     struct spinlock lock;
     char buf[INPUT_BUF];
@@ -178,6 +180,10 @@ void consoleintr (int (*getc) (void))
             procdump();
             break;
 
+        case C('F'):  // Free memory listing.
+            kmemdump();
+            break;
+
         case C('U'):  // Kill line.
             while ((input.e != input.w) && (input.buf[(input.e - 1) % INPUT_BUF] != '\n')) {
                 input.e--;
@@ -215,13 +221,22 @@ void consoleintr (int (*getc) (void))
     release(&input.lock);
 }
 
+// User memory is only touched with no spinlock held: the page
+// may have to be read back from swap, which sleeps. So a read
+// returns at most CONSCOPY bytes, and a write goes out in pieces
+// of that size.
 int consoleread (struct inode *ip, char *dst, int n)
 {
+    char buf[CONSCOPY];
     uint target;
     int c;
 
     iunlock(ip);
 
+    if (n > CONSCOPY) {
+        n = CONSCOPY;
+    }
+
     target = n;
     acquire(&input.lock);
 
@@ -248,7 +263,7 @@ int consoleread (struct inode *ip, char *dst, int n)
             break;
         }
 
-        *dst++ = c;
+        buf[target - n] = c;
         --n;
 
         if (c == '\n') {
@@ -257,6 +272,7 @@ int consoleread (struct inode *ip, char *dst, int n)
     }
 
     release(&input.lock);
+    memmove(dst, buf, target - n);
     ilock(ip);
 
     return target - n;
@@ -264,17 +280,23 @@ int consoleread (struct inode *ip, char *dst, int n)
 
 int consolewrite (struct inode *ip, char *buf, int n)
 {
-    int i;
+    char kbuf[CONSCOPY];
+    int i, j, m;
 
     iunlock(ip);
 
-    acquire(&cons.lock);
+    for (i = 0; i < n; i += m) {
+        m = (n - i < CONSCOPY) ? n - i : CONSCOPY;
+        memmove(kbuf, buf + i, m);
 
-    for (i = 0; i < n; i++) {
-        consputc(buf[i] & 0xff);
-    }
+        acquire(&cons.lock);
+
+        for (j = 0; j < m; j++) {
+            consputc(kbuf[j] & 0xff);
+        }
 
-    release(&cons.lock);
+        release(&cons.lock);
+    }
 
     ilock(ip);
 
@@ -0,0 +1,217 @@
+// Directory entry cache.
+//
+// Remembers the result of looking up a name in a directory, so that
+// path name lookup doesn't have to read the directory through the
+// buffer cache again. An entry maps (dev, directory inum, name) to
+// the inode number and the offset of the directory entry, or records
+// that the directory has no entry of that name (a negative entry,
+// with inum 0).
+//
+// Lookups and changes are made with the directory inode locked, so
+// an entry can't go stale while it is being used. dirlink() and
+// unlink keep the entries of a directory up to date, and iput()
+// drops them when it frees the directory.
+//
+// The cache takes one chunk of memory; when it is full, the least
+// recently used entry is recycled. dcache.lock protects the hash
+// chains and the LRU list.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "fs.h"
+
+#define DCHUNK_ORD  16  // size of the cache: one 64KB chunk
+
+struct dentry {
+    uint    dev;
+    uint    dir;            // inode number of the directory, 0 if unused
+    char    name[DIRSIZ];
+    uint    inum;           // 0 for a negative entry
+    uint    off;            // offset of the entry in the directory
+    struct dentry *hnext;   // hash chain
+    struct dentry *prev;    // LRU list
+    struct dentry *next;
+};
+
+struct {
+    struct spinlock lock;
+    int nentry;
+
+    struct dentry **bucket; // hash chains through hnext
+    uint nbucket;           // a power of 2
+
+    // Linked list of all entries, through prev/next.
+    // head.next is the most recently used.
+    struct dentry head;
+} dcache;
+
+static struct dentry** dhash (uint dev, uint dir, char *name)
+{
+    uint h;
+    int i;
+
+    h = dev * 31 + dir;
+
+    for (i = 0; (i < DIRSIZ) && (name[i] != 0); i++) {
+        h = h * 31 + name[i];
+    }
+
+    return &dcache.bucket[h & (dcache.nbucket - 1)];
+}
+
+void dcacheinit (void)
+{
+    struct dentry *d;
+    int i;
+
+    initlock(&dcache.lock, "dcache");
+
+    dcache.nentry = (1 << DCHUNK_ORD) / sizeof(struct dentry);
+    dcache.nbucket = 1;
+
+    while (dcache.nbucket * 2 <= dcache.nentry / 2) {
+        dcache.nbucket *= 2;
+    }
+
+    d = kmalloc(DCHUNK_ORD);
+    dcache.bucket = kmalloc(get_order(dcache.nbucket * sizeof(struct dentry*)));
+
+    if ((d == NULL) || (dcache.bucket == NULL)) {
+        panic("dcacheinit: no memory");
+    }
+
+    memset(d, 0, 1 << DCHUNK_ORD);
+    memset(dcache.bucket, 0, dcache.nbucket * sizeof(struct dentry*));
+
+    dcache.head.prev = &dcache.head;
+    dcache.head.next = &dcache.head;
+
+    for (i = 0; i < dcache.nentry; i++, d++) {
+        d->next = dcache.head.next;
+        d->prev = &dcache.head;
+        dcache.head.next->prev = d;
+        dcache.head.next = d;
+    }
+}
+
+// Find the entry for name in dir. Caller must hold dcache.lock.
+static struct dentry* dfind (uint dev, uint dir, char *name)
+{
+    struct dentry *d;
+
+    for (d = *dhash(dev, dir, name); d != NULL; d = d->hnext) {
+        if ((d->dev == dev) && (d->dir == dir) && (namecmp(d->name, name) == 0)) {
+            return d;
+        }
+    }
+
+    return NULL;
+}
+
+// Take d off its hash chain and mark it unused, leaving it at
+// the tail of the LRU list. Caller must hold dcache.lock.
+static void dunhash (struct dentry *d)
+{
+    struct dentry **pp;
+
+    for (pp = dhash(d->dev, d->dir, d->name); *pp != d; pp = &(*pp)->hnext)
+        ;
+
+    *pp = d->hnext;
+    d->dir = 0;
+
+    d->next->prev = d->prev;
+    d->prev->next = d->next;
+    d->prev = dcache.head.prev;
+    d->next = &dcache.head;
+    dcache.head.prev->next = d;
+    dcache.head.prev = d;
+}
+
+// Look up name in directory dir. Return 1 if the cache knows the
+// answer: *inum is the inode number, or 0 if dir has no such
+// entry, and *off the offset of the entry. Return 0 otherwise.
+int dcache_lookup (uint dev, uint dir, char *name, uint *inum, uint *off)
+{
+    struct dentry *d;
+
+    acquire(&dcache.lock);
+
+    if ((d = dfind(dev, dir, name)) == NULL) {
+        release(&dcache.lock);
+        return 0;
+    }
+
+    *inum = d->inum;
+    *off = d->off;
+
+    // move to the head of the MRU list
+    d->next->prev = d->prev;
+    d->prev->next = d->next;
+    d->next = dcache.head.next;
+    d->prev = &dcache.head;
+    dcache.head.next->prev = d;
+    dcache.head.next = d;
+
+    release(&dcache.lock);
+    return 1;
+}
+
+// Record that name in directory dir is inode inum, at offset off
+// in the directory; inum 0 records that there is no such entry.
+void dcache_enter (uint dev, uint dir, char *name, uint inum, uint off)
+{
+    struct dentry *d, **pp;
+
+    acquire(&dcache.lock);
+
+    if ((d = dfind(dev, dir, name)) != NULL) {
+        dunhash(d);
+    }
+
+    // recycle the least recently used entry
+    d = dcache.head.prev;
+
+    if (d->dir != 0) {
+        dunhash(d);
+    }
+
+    d->dev = dev;
+    d->dir = dir;
+    strncpy(d->name, name, DIRSIZ);
+    d->inum = inum;
+    d->off = off;
+
+    pp = dhash(dev, dir, name);
+    d->hnext = *pp;
+    *pp = d;
+
+    d->next->prev = d->prev;
+    d->prev->next = d->next;
+    d->next = dcache.head.next;
+    d->prev = &dcache.head;
+    dcache.head.next->prev = d;
+    dcache.head.next = d;
+
+    release(&dcache.lock);
+}
+
+// Forget all the entries of directory dir, which is being freed.
+void dcache_purge (uint dev, uint dir)
+{
+    struct dentry *d, *prev;
+
+    acquire(&dcache.lock);
+
+    for (d = dcache.head.prev; d != &dcache.head; d = prev) {
+        prev = d->prev;
+
+        if ((d->dev == dev) && (d->dir == dir)) {
+            dunhash(d);
+        }
+    }
+
+    release(&dcache.lock);
+}
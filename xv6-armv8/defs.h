@@ -12,12 +12,15 @@
 
 struct buf;
 struct context;
+struct cpage;
 struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct sleeplock;
 struct spinlock;
 struct stat;
+struct dirstat;
 struct superblock;
 struct trapframe;
 
@@ -42,8 +45,18 @@ void            show_callstk (char *);
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint);
+void            breadto(uint, uint, uchar*);
+void            breadtov(uint, uint*, uchar**, int);
+struct buf*     bnew(uint, uint);
+void            bmodify(struct buf*);
+int             bpending(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+void            bdwrite(struct buf*);
+void            bsync(void);
+void            bflushinit(void);
 
 // buddy.c
 void            kmem_init (void);
@@ -54,6 +67,12 @@ void            free_page(void *v);
 void*           alloc_page (void);
 void            kmem_test_b (void);
 int             get_order (uint32 v);
+int             kmem_compact (int order);
+int             kmem_nfree (int order);
+uint64          kmem_avail (void);
+void            kmemdump (void);
+void*           alloc_page_outside (uint64 lo, uint64 hi, void **held);
+void            kmem_release_held (void *held);
 
 // console.c
 void            consoleinit(void);
@@ -62,6 +81,12 @@ void		cprintf2 (char *fmt, uint64 arg, ...);
 void            consoleintr(int(*)(void));
 void            panic(char*) __attribute__((noreturn));
 
+// dcache.c
+void            dcacheinit(void);
+int             dcache_lookup(uint, uint, char*, uint*, uint*);
+void            dcache_enter(uint, uint, char*, uint, uint);
+void            dcache_purge(uint, uint);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -73,14 +98,18 @@ void            fileinit(void);
 int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
+int             filegetdents(struct file*, struct dirstat*, int n);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
+void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
+int             dirread(struct inode*, uint*, struct dirstat*, int);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
 void            iinit(void);
+void            ireadahead(struct inode*, uint, uint);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
@@ -96,6 +125,10 @@ int             writei(struct inode*, char*, uint, uint);
 // ide.c
 void            ideinit(void);
 void            iderw(struct buf*);
+void            iderwq(struct buf*);
+void            idestart(struct buf*);
+void            idewait(struct buf*);
+uchar*          ideaddr(uint, uint);
 
 // kalloc.c
 /*char*           kalloc(void);
@@ -108,7 +141,19 @@ void            kmem_init (void);*/
 void            initlog(void);
 void            log_write(struct buf*);
 void            begin_trans();
+void            begin_trans_n(int);
+int             log_maxblocks(void);
 void            commit_trans();
+void            log_age(void);
+void            log_sync(void);
+
+// pcache.c
+void            pcacheinit(void);
+struct cpage*   pcache_lookup(struct inode*, uint);
+struct cpage*   pcache_get(struct inode*, uint, int*);
+void            pcache_put(struct cpage*);
+void            pcache_modify(struct cpage*);
+void            pcache_drop(struct inode*);
 
 // picirq.c
 void            pic_enable(int, ISR);
@@ -125,22 +170,38 @@ int             pipewrite(struct pipe*, char*, int);
 // proc.c
 struct proc*    copyproc(struct proc*);
 void            exit(void);
+struct proc*    kthread(char*, void (*)(void));
 int             fork(void);
 int             growproc(int);
 int             kill(int);
 void            pinit(void);
 void            procdump(void);
+struct proc*    procslot(int);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
+void            wakeproc(struct proc*, void*);
 void            yield(void);
 
+// swap.c
+void            swapinit(void);
+int             swap_alloc(void);
+void            swap_free(uint);
+void            swap_write(uint, char*);
+void            swap_read(uint, char*);
+
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// sleeplock.c
+void            acquiresleep(struct sleeplock*);
+void            releasesleep(struct sleeplock*);
+int             holdingsleep(struct sleeplock*);
+void            initsleeplock(struct sleeplock*, char*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -159,9 +220,9 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, long*);
 int             argptr(int, char**, int);
-int             argstr(int, char**);
+int             argstr(int, char*, int);
 int             fetchint(uint64, long*);
-int             fetchstr(uint64, char**);
+int             fetchstr(uint64, char*, int);
 void            syscall(void);
 
 // timer.c
@@ -183,6 +244,17 @@ int             uartgetc(void);
 void            micro_delay(int us);
 void            uart_enable_rx();
 
+// usercopy.S
+int             user_copyin(void*, uint64, uint64);
+int             user_copyout(uint64, const void*, uint64);
+int             user_copyinstr(char*, uint64, uint64);
+
+// virtio.c
+int             virtio_init(void);
+uint            virtio_size(uint);
+int             virtio_start(struct buf*, int);
+void            virtio_wait(struct buf*);
+
 // vm.c
 int             allocuvm(pgd_t*, uint, uint);
 int             deallocuvm(pgd_t*, uint, uint);
@@ -192,13 +264,19 @@ int             loaduvm(pgd_t*, char*, struct inode*, uint, uint);
 pmd_t*          copyuvm(pgd_t*, uint);
 void            switchuvm(struct proc*);
 int             copyout(pgd_t*, uint, void*, uint);
+int             copyin(void*, uint64, uint);
+int             copyinstr(char*, uint64, uint);
 void            clearpteu(pgd_t *pgdir, char *uva);
 void*           kpt_alloc(void);
 void            init_vmm (void);
 void            kpt_freerange (uint64 low, uint64 hi);
 void            paging_init (uint64 phy_low, uint64 phy_hi);
+int             reclaim_page(void);
+int             pgfault(pgd_t*, uint64);
+int             move_upages(uint64, uint64, void**);
 
 // gic.c
 void 		gic_init(void* base);
+void            gic_ppi_enable(int, ISR);
 
 #endif
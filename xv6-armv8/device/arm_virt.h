@@ -21,9 +21,7 @@
 #define UART0           0x09000000
 #define UART_CLK        24000000    // Clock rate for UART
 
-#define TIMER0          0x1c110000
-#define TIMER1          0x1c120000
-#define CLK_HZ          1000000     // the clock is 1MHZ
+#define PIC_VTIMER      27          // the virtual timer, a PPI
 
 #define VIC_BASE        0x08000000
 #define PIC_TIMER01     13
@@ -31,4 +29,10 @@
 #define PIC_UART0       1
 #define PIC_GRAPHIC     19
 
+// the virtio-mmio transports, each with an interrupt of its own
+#define VIRTIO0         0x0a000000
+#define VIRTIO_STRIDE   0x200
+#define VIRTIO_NSLOT    32
+#define PIC_VIRTIO0     16
+
 #endif /* __ARM_VIRT__ */
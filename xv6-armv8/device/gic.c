@@ -193,9 +193,12 @@ int gic_getack()
 }
 
 /* ISR code */
-#define NUM_INTSRC		32 // numbers of interrupt source supported
+#define NUM_INTSRC		64 // numbers of interrupt source supported
+
+#define NUM_PPI			16 // private interrupts, ids 16 to 31
 
 static ISR isrs[NUM_INTSRC];
+static ISR ppis[NUM_PPI];
 
 static void default_isr (struct trapframe *tf, int n)
 {
@@ -203,18 +206,31 @@ static void default_isr (struct trapframe *tf, int n)
 }
 
 
+/* install the ISR for SPI n and enable it
+ */
 void pic_enable (int n, ISR isr)
 {
 	if(n < NUM_INTSRC) {
 		isrs[n] = isr;
+		gic_configure(SPI_TYPE, n);
 	}
 }
 
+/* install the ISR for PPI id and enable it
+ */
+void gic_ppi_enable (int id, ISR isr)
+{
+	ppis[id - 16] = isr;
+	gicd_set_bit(GICD_ISENABLE, id, 1);
+}
+
 void isr_init()
 {
 	int i;
 	for (i=0; i< NUM_INTSRC; i++)
 		isrs[i] = default_isr;
+	for (i=0; i< NUM_PPI; i++)
+		ppis[i] = default_isr;
 }
 /*
  * This section init gic according to CORTEX A15 reference manual
@@ -242,9 +258,17 @@ void pic_dispatch (struct trapframe *tp)
 {
 	int intid, intn;
 	intid = gic_getack(); /* iack */
+
+	if ((intid >= 16) && (intid < 32)) {
+		ppis[intid - 16](tp, intid);
+		GICC_REG(GICC_EOIR) = intid;
+		return;
+	}
+
 	intn = intid - 32;
+	if ((intn < 0) || (intn >= NUM_INTSRC))
+		return; /* spurious */
 	/* TODO: int disable here? **/
 	isrs[intn](tp, intn);
 	gic_eoi(intn);
 }
-
@@ -1,4 +1,6 @@
-// ARM dual-timer module support (SP804)
+// ARMv8 generic timer support. The virt machine has no SP804, so
+// the ticks come from the virtual timer of the CPU, and the short
+// delays from its counter.
 #include "types.h"
 #include "param.h"
 #include "arm.h"
@@ -7,45 +9,51 @@
 #include "memlayout.h"
 #include "spinlock.h"
 
-// A SP804 has two timers, we only use the first one, and as perodic timer
-
-// define registers (in units of 4-bytes)
-#define TIMER_LOAD	   0	// load register, for perodic timer
-#define TIMER_CURVAL   1	// current value of the counter
-#define TIMER_CONTROL  2	// control register
-#define TIMER_INTCLR   3	// clear (ack) the interrupt (any write clear it)
-#define TIMER_MIS      5	// masked interrupt status
-
-// control register bit definitions
-#define TIMER_ONESHOT  0x01	// wrap or one shot
-#define TIMER_32BIT    0x02 // 16-bit/32-bit counter
-#define TIMER_INTEN    0x20	// enable/disable interrupt
-#define TIMER_PERIODIC 0x40	// enable periodic mode
-#define TIMER_EN       0x80	// enable the timer
+// bits in CNTV_CTL_EL0
+#define TIMER_EN       0x01	// enable the timer
+#define TIMER_IMASK    0x02	// mask the interrupt
 
 void isr_timer (struct trapframe *tp, int irq_idx);
 
 struct spinlock tickslock;
 uint ticks;
 
-// acknowledge the timer, write any value to TIMER_INTCLR should do
+static uint64 interval;     // counter ticks between timer interrupts
+
+static uint64 timer_freq ()
+{
+    uint64 freq;
+
+    asm("MRS %[r], CNTFRQ_EL0": [r]"=r" (freq)::);
+    return freq;
+}
+
+static uint64 timer_count ()
+{
+    uint64 cnt;
+
+    asm("ISB" : : :);
+    asm("MRS %[r], CNTVCT_EL0": [r]"=r" (cnt)::);
+    return cnt;
+}
+
+// fire the timer interval counter ticks from now, which also
+// acknowledges the interrupt
 static void ack_timer ()
 {
-    volatile uint * timer0 = P2V(TIMER0);
-    timer0[TIMER_INTCLR] = 1;
+    asm("MSR CNTV_TVAL_EL0, %[v]": :[v]"r" (interval):);
 }
 
 // initialize the timer: perodical and interrupt based
 void timer_init(int hz)
 {
-    volatile uint * timer0 = P2V(TIMER0);
-
     initlock(&tickslock, "time");
 
-    timer0[TIMER_LOAD] = CLK_HZ / hz;
-    timer0[TIMER_CONTROL] = TIMER_EN|TIMER_PERIODIC|TIMER_32BIT|TIMER_INTEN;
+    interval = timer_freq() / hz;
+    ack_timer();
+    asm("MSR CNTV_CTL_EL0, %[v]": :[v]"r" ((uint64) TIMER_EN):);
 
-    pic_enable (PIC_TIMER01, isr_timer);
+    gic_ppi_enable (PIC_VTIMER, isr_timer);
 }
 
 // interrupt service routine for the timer
@@ -58,20 +66,14 @@ void isr_timer (struct trapframe *tp, int irq_idx)
     ack_timer();
 }
 
-// a short delay, use timer 1 as the source
+// a short delay, polling the counter
 void micro_delay (int us)
 {
-    volatile uint * timer1 = P2V(TIMER1);
+    uint64 end;
 
-    // load the initial value to timer1, and configure it to be freerun
-    timer1[TIMER_CONTROL] = TIMER_EN | TIMER_32BIT;
-    timer1[TIMER_LOAD] = us;
+    end = timer_count() + timer_freq() / 1000000 * us;
 
-    // the register will wrap to 0xFFFFFFFF after decrement to 0
-    while ((int)timer1[TIMER_CURVAL] > 0) {
+    while (timer_count() < end) {
 
     }
-
-    // disable timer
-    timer1[TIMER_CONTROL] = 0;
 }
@@ -0,0 +1,408 @@
+// Driver for the virtio block devices of the QEMU virt machine, on
+// the virtio-mmio transport. Both the legacy (version 1) and the
+// modern (version 2) register layouts are supported.
+//
+// Each disk has one split virtqueue of QSIZE descriptors. A request
+// takes a descriptor for its header, one for each block it moves and
+// one for the status the disk writes back. virtio_start puts it on
+// the available ring, notifies the disk and returns: requests from
+// several processes, and all those of a batch from iderwq, are in
+// flight together, and the disk may finish them in any order. When
+// it has put finished requests on the used ring, it interrupts, and
+// virtio_intr marks their buffers done and wakes up virtio_wait.
+//
+// A buffer with a request in flight has B_DISK set. It stays locked
+// by the process that started the request, which must leave it
+// alone until virtio_wait returns.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "arm.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "buf.h"
+#include "fs.h"
+
+// registers, in bytes from the base of a transport
+#define VIRTIO_MAGIC        0x000   // "virt"
+#define VIRTIO_VERSION      0x004
+#define VIRTIO_DEVICEID     0x008
+#define VIRTIO_DRVFEATURES  0x020   // features the driver accepts
+#define VIRTIO_DRVFEATSEL   0x024   // ... which word of them
+#define VIRTIO_PAGESIZE     0x028   // legacy only
+#define VIRTIO_QUEUESEL     0x030
+#define VIRTIO_QUEUENUMMAX  0x034
+#define VIRTIO_QUEUENUM     0x038
+#define VIRTIO_QUEUEALIGN   0x03c   // legacy only
+#define VIRTIO_QUEUEPFN     0x040   // legacy only
+#define VIRTIO_QUEUEREADY   0x044
+#define VIRTIO_QUEUENOTIFY  0x050
+#define VIRTIO_INTSTATUS    0x060
+#define VIRTIO_INTACK       0x064
+#define VIRTIO_STATUS       0x070
+#define VIRTIO_QUEUEDESC    0x080   // the rings, 64 bits: low word first
+#define VIRTIO_QUEUEAVAIL   0x090
+#define VIRTIO_QUEUEUSED    0x0a0
+#define VIRTIO_CAPACITY     0x100   // disk size in sectors, 64 bits
+
+#define MAGIC_VALUE         0x74726976
+#define DEVICE_BLK          2
+
+// bits in the status register
+#define STATUS_ACK          1
+#define STATUS_DRIVER       2
+#define STATUS_DRIVER_OK    4
+#define STATUS_FEATURES_OK  8
+
+#define F_VERSION_1         1       // feature 32, bit 0 of the second word
+
+#define SECTOR_SZ           512     // the unit of the disk address
+#define QSIZE               32      // descriptors in a queue
+#define NMERGE              8       // blocks a request may move
+#define NDISK               4
+
+struct vdesc {
+    uint64  addr;
+    uint32  len;
+    uint16  flags;
+    uint16  next;
+};
+
+#define VDESC_NEXT          1       // chained with the next field
+#define VDESC_WRITE         2       // the disk writes the buffer
+
+struct vavail {
+    uint16  flags;
+    uint16  idx;
+    uint16  ring[QSIZE];
+    uint16  unused;
+};
+
+struct vused {
+    uint16  flags;
+    uint16  idx;
+
+    struct {
+        uint32  id;     // head descriptor of a finished request
+        uint32  len;
+    } ring[QSIZE];
+};
+
+struct vreq {
+    uint32  type;
+    uint32  reserved;
+    uint64  sector;
+};
+
+#define VREQ_IN             0       // read
+#define VREQ_OUT            1       // write
+
+static struct disk {
+    struct spinlock lock;
+    volatile uchar *base;
+    int     irq;
+    uint    nblock;     // size, in BSIZE blocks
+
+    struct vdesc *desc;
+    volatile struct vavail *avail;
+    volatile struct vused *used;
+    uint16  used_idx;   // next entry of the used ring to look at
+
+    char    free[QSIZE];
+    int     nfree;
+
+    // by head descriptor: the first buffer of the request, how
+    // many follow it through qnext, and the header and status
+    // the request sends and gets back
+    struct buf *req[QSIZE];
+    int     nbuf[QSIZE];
+    struct vreq hdr[QSIZE];
+    uchar   status[QSIZE];
+} disks[NDISK];
+
+static int ndisk;
+
+static void virtio_intr (struct trapframe *tf, int irq);
+
+static uint32 vread (struct disk *d, int r)
+{
+    return *(volatile uint32*) (d->base + r);
+}
+
+static void vwrite (struct disk *d, int r, uint32 v)
+{
+    *(volatile uint32*) (d->base + r) = v;
+}
+
+// Set up d for the transport at base, if it has a block device.
+static int virtio_setup (struct disk *d, uint64 base, int irq)
+{
+    uint32 version;
+    uint64 nsector;
+    char *ring;
+    int i;
+
+    d->base = P2V(base);
+
+    if ((vread(d, VIRTIO_MAGIC) != MAGIC_VALUE) || (vread(d, VIRTIO_DEVICEID) != DEVICE_BLK)) {
+        return -1;
+    }
+
+    if (((version = vread(d, VIRTIO_VERSION)) != 1) && (version != 2)) {
+        return -1;
+    }
+
+    vwrite(d, VIRTIO_STATUS, 0);
+    vwrite(d, VIRTIO_STATUS, STATUS_ACK);
+    vwrite(d, VIRTIO_STATUS, STATUS_ACK | STATUS_DRIVER);
+
+    // none of the optional features, but a modern device must
+    // be told that we know the version 1 interface
+    vwrite(d, VIRTIO_DRVFEATSEL, 0);
+    vwrite(d, VIRTIO_DRVFEATURES, 0);
+
+    if (version == 2) {
+        vwrite(d, VIRTIO_DRVFEATSEL, 1);
+        vwrite(d, VIRTIO_DRVFEATURES, F_VERSION_1);
+        vwrite(d, VIRTIO_STATUS, STATUS_ACK | STATUS_DRIVER | STATUS_FEATURES_OK);
+
+        if (!(vread(d, VIRTIO_STATUS) & STATUS_FEATURES_OK)) {
+            return -1;
+        }
+    } else {
+        vwrite(d, VIRTIO_PAGESIZE, PTE_SZ);
+    }
+
+    vwrite(d, VIRTIO_QUEUESEL, 0);
+
+    if (vread(d, VIRTIO_QUEUENUMMAX) < QSIZE) {
+        return -1;
+    }
+
+    // The legacy layout of the rings, which the modern interface
+    // is happy with too: the descriptors, then the available ring,
+    // then the used ring in the next page.
+    if ((ring = kmalloc(get_order(2 * PTE_SZ))) == NULL) {
+        return -1;
+    }
+
+    memset(ring, 0, 2 * PTE_SZ);
+
+    d->desc = (struct vdesc*) ring;
+    d->avail = (struct vavail*) (ring + QSIZE * sizeof(struct vdesc));
+    d->used = (struct vused*) (ring + PTE_SZ);
+
+    vwrite(d, VIRTIO_QUEUENUM, QSIZE);
+
+    if (version == 2) {
+        vwrite(d, VIRTIO_QUEUEDESC, V2P(d->desc));
+        vwrite(d, VIRTIO_QUEUEDESC + 4, V2P(d->desc) >> 32);
+        vwrite(d, VIRTIO_QUEUEAVAIL, V2P(d->avail));
+        vwrite(d, VIRTIO_QUEUEAVAIL + 4, V2P(d->avail) >> 32);
+        vwrite(d, VIRTIO_QUEUEUSED, V2P(d->used));
+        vwrite(d, VIRTIO_QUEUEUSED + 4, V2P(d->used) >> 32);
+        vwrite(d, VIRTIO_QUEUEREADY, 1);
+    } else {
+        vwrite(d, VIRTIO_QUEUEALIGN, PTE_SZ);
+        vwrite(d, VIRTIO_QUEUEPFN, V2P(ring) >> PTE_SHIFT);
+    }
+
+    nsector = vread(d, VIRTIO_CAPACITY) | ((uint64) vread(d, VIRTIO_CAPACITY + 4) << 32);
+    d->nblock = nsector / (BSIZE / SECTOR_SZ);
+
+    initlock(&d->lock, "virtio");
+    d->irq = irq;
+    d->used_idx = 0;
+
+    for (i = 0; i < QSIZE; i++) {
+        d->free[i] = 1;
+    }
+
+    d->nfree = QSIZE;
+
+    pic_enable(irq, virtio_intr);
+    vwrite(d, VIRTIO_STATUS, vread(d, VIRTIO_STATUS) | STATUS_DRIVER_OK);
+
+    return 0;
+}
+
+// Find the virtio disks; return how many there are. QEMU fills
+// the transports from the top, so scanning down numbers the disks
+// in the order they are given on its command line.
+int virtio_init (void)
+{
+    int slot;
+
+    for (slot = VIRTIO_NSLOT - 1; (slot >= 0) && (ndisk < NDISK); slot--) {
+        if (virtio_setup(&disks[ndisk], VIRTIO0 + slot * VIRTIO_STRIDE, PIC_VIRTIO0 + slot) == 0) {
+            cprintf("virtio: disk %d, %d blocks\n", ndisk + 1, disks[ndisk].nblock);
+            ndisk++;
+        }
+    }
+
+    return ndisk;
+}
+
+// Size of disk dev, in BSIZE blocks.
+uint virtio_size (uint dev)
+{
+    return disks[dev - 1].nblock;
+}
+
+// Take a free descriptor. Caller must hold d->lock.
+static int valloc (struct disk *d)
+{
+    int i;
+
+    for (i = 0; i < QSIZE; i++) {
+        if (d->free[i]) {
+            d->free[i] = 0;
+            d->nfree--;
+            return i;
+        }
+    }
+
+    panic("valloc");
+}
+
+// Start moving b and at most n - 1 of the buffers that follow it
+// through qnext, as far as they are for the next blocks of the disk
+// and go the same way, as one request. Return how many it takes.
+// Wait only for room in the queue.
+int virtio_start (struct buf *b, int n)
+{
+    struct disk *d;
+    struct buf *p;
+    int head, prev, i, k, write;
+
+    d = &disks[b->dev - 1];
+    write = b->flags & B_DIRTY;
+
+    for (k = 1, p = b; (k < n) && (k < NMERGE); k++, p = p->qnext) {
+        if ((p->qnext->dev != b->dev) || (p->qnext->sector != p->sector + 1)
+                || ((p->qnext->flags & B_DIRTY) != write)) {
+            break;
+        }
+    }
+
+    acquire(&d->lock);
+
+    while (d->nfree < k + 2) {
+        sleep(&d->nfree, &d->lock);
+    }
+
+    head = valloc(d);
+
+    d->hdr[head].type = write ? VREQ_OUT : VREQ_IN;
+    d->hdr[head].reserved = 0;
+    d->hdr[head].sector = (uint64) b->sector * (BSIZE / SECTOR_SZ);
+    d->status[head] = 0xff;
+
+    d->desc[head].addr = V2P(&d->hdr[head]);
+    d->desc[head].len = sizeof(d->hdr[head]);
+    d->desc[head].flags = VDESC_NEXT;
+
+    prev = head;
+
+    for (i = 0, p = b; i < k; i++, p = p->qnext) {
+        p->flags |= B_DISK;
+
+        d->desc[prev].next = valloc(d);
+        prev = d->desc[prev].next;
+
+        d->desc[prev].addr = V2P(p->data);
+        d->desc[prev].len = BSIZE;
+        d->desc[prev].flags = VDESC_NEXT | (write ? 0 : VDESC_WRITE);
+    }
+
+    d->desc[prev].next = valloc(d);
+    prev = d->desc[prev].next;
+
+    d->desc[prev].addr = V2P(&d->status[head]);
+    d->desc[prev].len = 1;
+    d->desc[prev].flags = VDESC_WRITE;
+
+    d->req[head] = b;
+    d->nbuf[head] = k;
+
+    // the disk must see the entry before the index that covers it
+    d->avail->ring[d->avail->idx % QSIZE] = head;
+    __sync_synchronize();
+    d->avail->idx++;
+    __sync_synchronize();
+
+    vwrite(d, VIRTIO_QUEUENOTIFY, 0);
+
+    release(&d->lock);
+    return k;
+}
+
+// Wait for the request started for b to finish.
+void virtio_wait (struct buf *b)
+{
+    struct disk *d;
+
+    d = &disks[b->dev - 1];
+
+    acquire(&d->lock);
+
+    while (b->flags & B_DISK) {
+        sleep(b, &d->lock);
+    }
+
+    release(&d->lock);
+}
+
+static void virtio_intr (struct trapframe *tf, int irq)
+{
+    struct disk *d;
+    struct buf *b;
+    int head, i;
+
+    for (d = disks; (d < disks + ndisk) && (d->irq != irq); d++)
+        ;
+
+    if (d == disks + ndisk) {
+        return;
+    }
+
+    acquire(&d->lock);
+
+    // acknowledge first: a request that finishes after this
+    // raises the interrupt again
+    vwrite(d, VIRTIO_INTACK, vread(d, VIRTIO_INTSTATUS) & 0x3);
+    __sync_synchronize();
+
+    while (d->used_idx != d->used->idx) {
+        __sync_synchronize();
+        head = d->used->ring[d->used_idx % QSIZE].id;
+
+        if (d->status[head] != 0) {
+            panic("virtio_intr: disk error");
+        }
+
+        // a write leaves the buffer clean, a read makes it valid
+        for (i = 0, b = d->req[head]; i < d->nbuf[head]; i++, b = b->qnext) {
+            b->flags = (b->flags & ~(B_DIRTY | B_DISK)) | B_VALID;
+            wakeup(b);
+        }
+
+        for (i = head; ; i = d->desc[i].next) {
+            d->free[i] = 1;
+            d->nfree++;
+
+            if (!(d->desc[i].flags & VDESC_NEXT)) {
+                break;
+            }
+        }
+
+        d->req[head] = NULL;
+        d->used_idx++;
+    }
+
+    wakeup(&d->nfree);
+    release(&d->lock);
+}
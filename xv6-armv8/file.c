@@ -6,8 +6,9 @@
 #include "defs.h"
 #include "param.h"
 #include "fs.h"
-#include "file.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
 
 struct devsw devsw[NDEV];
 struct {
@@ -30,6 +31,9 @@ struct file* filealloc (void)
     for (f = ftable.file; f < ftable.file + NFILE; f++) {
         if (f->ref == 0) {
             f->ref = 1;
+            f->ra_next = 0;
+            f->ra_win = 0;
+            f->ra_end = 0;
             release(&ftable.lock);
             return f;
         }
@@ -98,6 +102,47 @@ int filestat (struct file *f, struct stat *st)
     return -1;
 }
 
+// Readahead window for sequential reads, in blocks. The window
+// starts at RA_MIN and doubles each time it is refilled.
+#define RA_MIN  4
+#define RA_MAX  64
+
+// f has just read n bytes at off. If the reads are sequential, start
+// reading the blocks ahead of the reader, without waiting for them;
+// a read that jumps elsewhere closes the window. Caller must hold
+// f->ip->lock.
+static void readahead (struct file *f, uint off, uint n)
+{
+    uint bn, start;
+
+    if (off != f->ra_next) {
+        f->ra_next = off + n;
+        f->ra_win = 0;
+        f->ra_end = 0;
+        return;
+    }
+
+    f->ra_next = off + n;
+    bn = f->ra_next / BSIZE;
+
+    if (f->ra_win == 0) {
+        f->ra_win = RA_MIN;
+    }
+
+    // refill once the reader is halfway into the window
+    if (bn + f->ra_win / 2 < f->ra_end) {
+        return;
+    }
+
+    start = (f->ra_end > bn) ? f->ra_end : bn;
+    ireadahead(f->ip, start * BSIZE, (bn + f->ra_win - start) * BSIZE);
+    f->ra_end = bn + f->ra_win;
+
+    if (f->ra_win < RA_MAX) {
+        f->ra_win *= 2;
+    }
+}
+
 // Read from file f.
 int fileread (struct file *f, char *addr, int n)
 {
@@ -115,6 +160,7 @@ int fileread (struct file *f, char *addr, int n)
         ilock(f->ip);
 
         if ((r = readi(f->ip, addr, f->off, n)) > 0) {
+            readahead(f, f->off, r);
             f->off += r;
         }
 
@@ -126,6 +172,16 @@ int fileread (struct file *f, char *addr, int n)
     panic("fileread");
 }
 
+// Read up to n entries of directory f into ds.
+int filegetdents (struct file *f, struct dirstat *ds, int n)
+{
+    if ((f->readable == 0) || (f->type != FD_INODE)) {
+        return -1;
+    }
+
+    return dirread(f->ip, &f->off, ds, n);
+}
+
 //PAGEBREAK!
 // Write to file f.
 int filewrite (struct file *f, char *addr, int n)
@@ -134,6 +190,7 @@ int filewrite (struct file *f, char *addr, int n)
     int i;
     int max;
     int n1;
+    int nblocks;
 
     if (f->writable == 0) {
         return -1;
@@ -144,13 +201,13 @@ int filewrite (struct file *f, char *addr, int n)
     }
 
     if (f->type == FD_INODE) {
-        // write a few blocks at a time to avoid exceeding
-        // the maximum log transaction size, including
-        // i-node, indirect block, allocation blocks,
-        // and 2 blocks of slop for non-aligned writes.
+        // write as many blocks at a time as one transaction
+        // may hold, including i-node, indirect blocks, allocation
+        // blocks, and 2 blocks of slop for non-aligned writes.
         // this really belongs lower down, since writei()
         // might be writing a device like the console.
-        max = ((LOGSIZE - 1 - 1 - 2) / 2) * 512;
+        nblocks = log_maxblocks();
+        max = ((nblocks - 1 - 1 - 2) / 2) * BSIZE;
         i = 0;
 
         while (i < n) {
@@ -160,7 +217,7 @@ int filewrite (struct file *f, char *addr, int n)
                 n1 = max;
             }
 
-            begin_trans();
+            begin_trans_n(nblocks);
             ilock(f->ip);
 
             if ((r = writei(f->ip, addr + i, f->off, n1)) > 0) {
@@ -6,6 +6,9 @@ struct file {
     struct pipe  *pipe;
     struct inode *ip;
     uint         off;
+    uint         ra_next;   // offset a sequential reader reads next
+    uint         ra_win;    // readahead window, in blocks
+    uint         ra_end;    // first block not yet read ahead
 };
 
 
@@ -14,18 +17,38 @@ struct inode {
     uint    dev;        // Device number
     uint    inum;       // Inode number
     int     ref;        // Reference count
-    int     flags;      // I_BUSY, I_VALID
+    struct inode *hnext;    // hash chain
+    struct inode *prev;     // LRU list
+    struct inode *next;
+    struct sleeplock lock;  // protects everything below here
+    int     flags;      // I_VALID
 
     short   type;       // copy of disk inode
     short   major;
     short   minor;
     short   nlink;
     uint    size;
-    uint    addrs[NDIRECT+1];
+    uint    addrs[NDIRECT+NLEVEL];
+    uint    mapbase;    // first file block mapped by mapblk,
+    uint    mapblk;     // the last indirect block bmap used (0 if none)
+    uint    run;        // blocks writei allocated for bmap to use,
+    uint    nrun;       // nrun of them starting at run
+    void    *pages;     // page cache: root of a radix tree of cpages
+    int     pheight;    // and its height (see pcache.c)
 };
-#define I_BUSY 0x1
 #define I_VALID 0x2
 
+// a page of file data in the page cache
+struct cpage {
+    struct inode *ip;
+    uint    pn;         // page number in the file
+    int     ref;        // held while its data is being copied
+    struct cpage *prev; // LRU list
+    struct cpage *next;
+    char    *data;      // PTE_SZ bytes: mem, or the disk's own
+    char    *mem;       // the page's own PTE_SZ bytes
+};
+
 // table mapping major device number to
 // device functions
 struct devsw {
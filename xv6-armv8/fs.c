@@ -16,12 +16,13 @@
 #include "mmu.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "buf.h"
 #include "fs.h"
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
-static void itrunc (struct inode*);
+static int itrunc (struct inode*);
 
 // Read the super block.
 void readsb (int dev, struct superblock *sb)
@@ -31,6 +32,10 @@ void readsb (int dev, struct superblock *sb)
     bp = bread(dev, 1);
     memmove(sb, bp->data, sizeof(*sb));
     brelse(bp);
+
+    if (sb->bsize != BSIZE) {
+        panic("readsb: block size");
+    }
 }
 
 // Zero a block.
@@ -38,54 +43,201 @@ static void bzero (int dev, int bno)
 {
     struct buf *bp;
 
-    bp = bread(dev, bno);
+    bp = bnew(dev, bno);
     memset(bp->data, 0, BSIZE);
     log_write(bp);
     brelse(bp);
 }
 
+// The mounted file system: a copy of its superblock, and the
+// state of the block and inode allocators.
+struct {
+    struct spinlock lock;
+    uint dev;
+    struct superblock sb;
+    uint nblock;    // blocks the allocator may use: the log follows
+    uint nfree;     // free blocks
+    uint next;      // where to look for a free block first
+    uint *imap;     // inodes in use, a bit per inode
+} fsys;
+
+// Count the zero bits in w.
+static int nzero (uint w)
+{
+    int n;
+
+    for (n = 0, w = ~w; w != 0; n++) {
+        w &= w - 1;
+    }
+
+    return n;
+}
+
+// Build the map of inodes in use from the inode table on disk.
+static void imapinit (int dev)
+{
+    struct buf *bp;
+    struct dinode *dip;
+    uint inum, nw;
+
+    nw = (fsys.sb.ninodes + 31) / 32;
+
+    if ((fsys.imap = kmalloc(get_order(nw * sizeof(uint)))) == NULL) {
+        panic("imapinit: no memory");
+    }
+
+    // inode 0 and the bits past the last inode are never free
+    memset(fsys.imap, 0, nw * sizeof(uint));
+    fsys.imap[0] = 1;
+
+    for (inum = fsys.sb.ninodes; inum < nw * 32; inum++) {
+        fsys.imap[inum / 32] |= 1 << (inum % 32);
+    }
+
+    for (inum = 1; inum < fsys.sb.ninodes; inum++) {
+        bp = bread(dev, IBLOCK(inum));
+        dip = (struct dinode*) bp->data + inum % IPB;
+
+        if (dip->type != 0) {
+            fsys.imap[inum / 32] |= 1 << (inum % 32);
+        }
+
+        brelse(bp);
+    }
+}
+
+// Read in the superblock of dev, count its free blocks and
+// find its free inodes. Called once, after the log has been
+// recovered.
+void fsinit (int dev)
+{
+    struct buf *bp;
+    uint b, w;
+
+    initlock(&fsys.lock, "fsys");
+    readsb(dev, &fsys.sb);
+    fsys.dev = dev;
+    fsys.nblock = fsys.sb.size - fsys.sb.nlog;
+    fsys.nfree = 0;
+
+    for (b = 0; b < fsys.nblock; b += BPB) {
+        bp = bread(dev, BBLOCK(b, fsys.sb.ninodes));
+
+        for (w = 0; (w < BPB / 32) && (b + w * 32 < fsys.nblock); w++) {
+            if (b + w * 32 + 32 <= fsys.nblock) {
+                fsys.nfree += nzero(((uint*) bp->data)[w]);
+            } else {  // bits of the log, or past the end of the disk
+                fsys.nfree += nzero(((uint*) bp->data)[w] | (~0U << (fsys.nblock % 32)));
+            }
+        }
+
+        brelse(bp);
+    }
+
+    fsys.next = 0;
+    imapinit(dev);
+}
+
 // Blocks.
 
-// Allocate a zeroed disk block.
-static uint balloc (uint dev)
+// Look for a free block in [from, to), a word of the bitmap at a
+// time, and mark it in use, along with the free blocks right after
+// it: up to n blocks in all, *got of them. Return the first, or 0
+// if there is none (block 0 is never free).
+static uint bscan (uint dev, uint from, uint to, uint n, uint *got)
 {
-    int b, bi, m;
     struct buf *bp;
-    struct superblock sb;
+    uint b, w, x, *map;
+
+    b = from - from % 32;
 
-    bp = 0;
-    readsb(dev, &sb);
+    while (b < to) {
+        bp = bread(dev, BBLOCK(b, fsys.sb.ninodes));
+        map = (uint*) bp->data;
 
-    for (b = 0; b < sb.size; b += BPB) {
-        bp = bread(dev, BBLOCK(b, sb.ninodes));
+        do {
+            if ((w = map[(b % BPB) / 32]) != ~0U) {
+                b += __builtin_ctz(~w);
 
-        for (bi = 0; bi < BPB && b + bi < sb.size; bi++) {
-            m = 1 << (bi % 8);
+                if (b >= to) {
+                    break;
+                }
+
+                bmodify(bp);
+                map = (uint*) bp->data;
+                map[(b % BPB) / 32] |= 1 << (b % 32);  // Mark block in use.
+
+                for (*got = 1, x = b + 1; (*got < n) && (x < to) && (x % BPB != 0); (*got)++, x++) {
+                    if (map[(x % BPB) / 32] & (1 << (x % 32))) {
+                        break;
+                    }
+
+                    map[(x % BPB) / 32] |= 1 << (x % 32);
+                }
 
-            if ((bp->data[bi / 8] & m) == 0) {  // Is block free?
-                bp->data[bi / 8] |= m;  // Mark block in use.
                 log_write(bp);
                 brelse(bp);
-                bzero(dev, b + bi);
-                return b + bi;
+                return b;
             }
-        }
+
+            b += 32;
+        } while ((b < to) && (b % BPB != 0));
 
         brelse(bp);
     }
 
-    panic("balloc: out of blocks");
+    return 0;
+}
+
+// Allocate a run of up to n disk blocks, *got of them, starting
+// with the first free one at or after goal if possible. With goal
+// 0, continue after the last one allocated. The blocks are not
+// zeroed.
+static uint brun (uint dev, uint goal, uint n, uint *got)
+{
+    uint b, start;
+
+    acquire(&fsys.lock);
+
+    if (fsys.nfree == 0) {
+        panic("balloc: out of blocks");
+    }
+
+    start = ((goal != 0) && (goal < fsys.nblock)) ? goal : fsys.next;
+    release(&fsys.lock);
+
+    // never into the log, whatever the bitmap says
+    if (((b = bscan(dev, start, fsys.nblock, n, got)) == 0) &&
+        ((b = bscan(dev, 0, start, n, got)) == 0)) {
+        panic("balloc: out of blocks");
+    }
+
+    acquire(&fsys.lock);
+    fsys.nfree -= *got;
+    fsys.next = b + *got;
+    release(&fsys.lock);
+
+    return b;
+}
+
+// Allocate a zeroed disk block, at goal if possible (see brun).
+static uint balloc (uint dev, uint goal)
+{
+    uint b, got;
+
+    b = brun(dev, goal, 1, &got);
+    bzero(dev, b);
+
+    return b;
 }
 
 // Free a disk block.
 static void bfree (int dev, uint b)
 {
     struct buf *bp;
-    struct superblock sb;
     int bi, m;
 
-    readsb(dev, &sb);
-    bp = bread(dev, BBLOCK(b, sb.ninodes));
+    bp = bread(dev, BBLOCK(b, fsys.sb.ninodes));
     bi = b % BPB;
     m = 1 << (bi % 8);
 
@@ -93,9 +245,14 @@ static void bfree (int dev, uint b)
         panic("freeing free block");
     }
 
+    bmodify(bp);
     bp->data[bi / 8] &= ~m;
     log_write(bp);
     brelse(bp);
+
+    acquire(&fsys.lock);
+    fsys.nfree++;
+    release(&fsys.lock);
 }
 
 // Inodes.
@@ -115,6 +272,13 @@ static void bfree (int dev, uint b)
 // inodes include book-keeping information that is
 // not stored on disk: ip->ref and ip->flags.
 //
+// The cache is sized at boot to a share of the free memory.
+// Entries are found through a hash table keyed by (dev, inum).
+// An entry whose ref has fallen to zero stays cached, and valid,
+// until it is recycled for another inode, least recently
+// released first. icache.lock protects the hash chains, the
+// LRU list and the reference counts.
+//
 // An inode and its in-memory represtative go through a
 // sequence of states before they can be used by the
 // rest of the file system code.
@@ -124,7 +288,7 @@ static void bfree (int dev, uint b)
 //   the link count has fallen to zero.
 //
 // * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
+//   can be recycled if ip->ref is zero. Otherwise ip->ref tracks
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() to find or
 //   create a cache entry and increment its ref, iput()
@@ -134,13 +298,13 @@ static void bfree (int dev, uint b)
 //   cache entry is only correct when the I_VALID bit
 //   is set in ip->flags. ilock() reads the inode from
 //   the disk and sets I_VALID, while iput() clears
-//   I_VALID if ip->ref has fallen to zero.
+//   I_VALID when it frees the inode.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
-//   has first locked the inode. The I_BUSY flag indicates
-//   that the inode is locked. ilock() sets I_BUSY,
-//   while iunlock clears it.
+//   has first locked the inode with its sleep lock, which
+//   may be held across disk I/O. ilock() acquires the lock,
+//   while iunlock releases it.
 //
 // Thus a typical sequence is:
 //   ip = iget(dev, inum)
@@ -160,35 +324,145 @@ static void bfree (int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 
+#define ICACHE_SHARE    256 // the cache takes 1/ICACHE_SHARE of free memory
+#define ICHUNK_ORD      16  // entries are allocated 64KB at a time
+
 struct {
     struct spinlock lock;
-    struct inode inode[NINODE];
+    int ninode;
+    int wanted;             // someone is waiting for a free entry
+
+    struct inode **bucket;  // hash chains through hnext
+    uint nbucket;           // a power of 2
+
+    // Linked list of all entries, through prev/next.
+    // head.next is the most recently released.
+    struct inode head;
 } icache;
 
+static struct inode** ihash (uint dev, uint inum)
+{
+    return &icache.bucket[(inum ^ (dev << 16)) & (icache.nbucket - 1)];
+}
+
 void iinit (void)
 {
+    struct inode *ip;
+    uint i, n, per_chunk;
+
     initlock(&icache.lock, "icache");
+
+    n = kmem_avail() / ICACHE_SHARE / sizeof(struct inode);
+
+    if (n < NINODE) {
+        n = NINODE;
+    }
+
+    // about four entries per bucket, as many buckets as fit in a chunk
+    icache.nbucket = 1;
+
+    while ((icache.nbucket * 2 <= n / 4) &&
+           (icache.nbucket * 2 * sizeof(struct inode*) <= (1 << ICHUNK_ORD))) {
+        icache.nbucket *= 2;
+    }
+
+    if ((icache.bucket = kmalloc(get_order(icache.nbucket * sizeof(struct inode*)))) == NULL) {
+        panic("iinit: no memory for hash table");
+    }
+
+    memset(icache.bucket, 0, icache.nbucket * sizeof(struct inode*));
+
+    icache.head.prev = &icache.head;
+    icache.head.next = &icache.head;
+
+    per_chunk = (1 << ICHUNK_ORD) / sizeof(struct inode);
+    i = 0;
+
+    for (icache.ninode = 0; icache.ninode < n; icache.ninode++) {
+        if (i == 0) {
+            if ((ip = kmalloc(ICHUNK_ORD)) == NULL) {
+                break;
+            }
+
+            i = per_chunk;
+        }
+
+        // inum 0 marks an entry that is not in the hash table
+        memset(ip, 0, sizeof(*ip));
+        initsleeplock(&ip->lock, "inode");
+
+        ip->next = icache.head.next;
+        ip->prev = &icache.head;
+        icache.head.next->prev = ip;
+        icache.head.next = ip;
+
+        ip++;
+        i--;
+    }
+
+    if (icache.ninode < NINODE) {
+        panic("iinit: no memory for inodes");
+    }
+
+    cprintf("icache: %d inodes, %d buckets\n", icache.ninode, icache.nbucket);
 }
 
 static struct inode* iget (uint dev, uint inum);
 
 //PAGEBREAK!
-// Allocate a new inode with the given type on device dev.
+// Take a free inode from the in-memory map, the first one at or
+// after near if possible. Return 0 if there is none.
+static uint ifind (uint near)
+{
+    uint i, w, nw, inum;
+
+    nw = (fsys.sb.ninodes + 31) / 32;
+
+    if (near >= fsys.sb.ninodes) {
+        near = 0;
+    }
+
+    acquire(&fsys.lock);
+
+    for (i = 0; i < nw; i++) {
+        w = (near / 32 + i) % nw;
+
+        if (fsys.imap[w] != ~0U) {
+            inum = w * 32 + __builtin_ctz(~fsys.imap[w]);
+            fsys.imap[w] |= 1 << (inum % 32);
+            release(&fsys.lock);
+            return inum;
+        }
+    }
+
+    release(&fsys.lock);
+    return 0;
+}
+
+// Return inode inum to the in-memory map of free inodes.
+static void ifree (uint inum)
+{
+    acquire(&fsys.lock);
+    fsys.imap[inum / 32] &= ~(1 << (inum % 32));
+    release(&fsys.lock);
+}
+
+// Allocate a new inode with the given type on device dev, near
+// inode near (usually the parent directory) if possible.
 // A free inode has a type of zero.
-struct inode* ialloc (uint dev, short type)
+struct inode* ialloc (uint dev, short type, uint near)
 {
-    int inum;
+    uint inum;
     struct buf *bp;
     struct dinode *dip;
-    struct superblock sb;
-
-    readsb(dev, &sb);
 
-    for (inum = 1; inum < sb.ninodes; inum++) {
+    while ((inum = ifind(near)) != 0) {
         bp = bread(dev, IBLOCK(inum));
         dip = (struct dinode*) bp->data + inum % IPB;
 
         if (dip->type == 0) {  // a free inode
+            bmodify(bp);
+            dip = (struct dinode*) bp->data + inum % IPB;
             memset(dip, 0, sizeof(*dip));
             dip->type = type;
             log_write(bp);   // mark it allocated on the disk
@@ -196,7 +470,7 @@ struct inode* ialloc (uint dev, short type)
             return iget(dev, inum);
         }
 
-        brelse(bp);
+        brelse(bp);  // in use after all, leave it marked
     }
 
     panic("ialloc: no inodes");
@@ -209,6 +483,7 @@ void iupdate (struct inode *ip)
     struct dinode *dip;
 
     bp = bread(ip->dev, IBLOCK(ip->inum));
+    bmodify(bp);
 
     dip = (struct dinode*) bp->data + ip->inum % IPB;
     dip->type = ip->type;
@@ -227,38 +502,49 @@ void iupdate (struct inode *ip)
 // the inode and does not read it from disk.
 static struct inode* iget (uint dev, uint inum)
 {
-    struct inode *ip, *empty;
+    struct inode *ip, **pp;
 
     acquire(&icache.lock);
 
+    loop:
     // Is the inode already cached?
-    empty = 0;
-
-    for (ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++) {
-        if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
+    for (ip = *ihash(dev, inum); ip != NULL; ip = ip->hnext) {
+        if (ip->dev == dev && ip->inum == inum) {
             ip->ref++;
             release(&icache.lock);
             return ip;
         }
+    }
 
-        if (empty == 0 && ip->ref == 0) {   // Remember empty slot.
-            empty = ip;
+    // Recycle the least recently released entry that is not in use.
+    for (ip = icache.head.prev; ip != &icache.head; ip = ip->prev) {
+        if (ip->ref != 0) {
+            continue;
         }
-    }
 
-    // Recycle an inode cache entry.
-    if (empty == 0) {
-        panic("iget: no inodes");
-    }
+        if (ip->inum != 0) {
+            for (pp = ihash(ip->dev, ip->inum); *pp != ip; pp = &(*pp)->hnext)
+                ;
 
-    ip = empty;
-    ip->dev = dev;
-    ip->inum = inum;
-    ip->ref = 1;
-    ip->flags = 0;
-    release(&icache.lock);
+            *pp = ip->hnext;
+            pcache_drop(ip);
+        }
 
-    return ip;
+        ip->dev = dev;
+        ip->inum = inum;
+        ip->ref = 1;
+        ip->flags = 0;
+        ip->hnext = *ihash(dev, inum);
+        *ihash(dev, inum) = ip;
+
+        release(&icache.lock);
+        return ip;
+    }
+
+    // All the entries are in use; wait for one to be released.
+    icache.wanted = 1;
+    sleep(&icache, &icache.lock);
+    goto loop;
 }
 
 // Increment reference count for ip.
@@ -282,13 +568,7 @@ void ilock (struct inode *ip)
         panic("ilock");
     }
 
-    acquire(&icache.lock);
-    while (ip->flags & I_BUSY) {
-        sleep(ip, &icache.lock);
-    }
-
-    ip->flags |= I_BUSY;
-    release(&icache.lock);
+    acquiresleep(&ip->lock);
 
     if (!(ip->flags & I_VALID)) {
         bp = bread(ip->dev, IBLOCK(ip->inum));
@@ -302,6 +582,7 @@ void ilock (struct inode *ip)
 
         memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
         brelse(bp);
+        ip->mapblk = 0;
         ip->flags |= I_VALID;
 
         if (ip->type == 0) {
@@ -313,14 +594,11 @@ void ilock (struct inode *ip)
 // Unlock the given inode.
 void iunlock (struct inode *ip)
 {
-    if (ip == 0 || !(ip->flags & I_BUSY) || ip->ref < 1) {
+    if (ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1) {
         panic("iunlock");
     }
 
-    acquire(&icache.lock);
-    ip->flags &= ~I_BUSY;
-    wakeup(ip);
-    release(&icache.lock);
+    releasesleep(&ip->lock);
 }
 
 // Drop a reference to an in-memory inode.
@@ -334,22 +612,46 @@ void iput (struct inode *ip)
 
     if (ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0) {
         // inode has no links: truncate and free inode.
-        if (ip->flags & I_BUSY) {
-            panic("iput busy");
+        // ip->ref == 1 means no other process can have ip locked,
+        // so this acquiresleep() won't block (or deadlock).
+        acquiresleep(&ip->lock);
+        release(&icache.lock);
+
+        if (ip->type == T_DIR) {
+            dcache_purge(ip->dev, ip->inum);
+        }
+
+        // free the content in pieces that fit in the log, and
+        // restart the operation between them
+        while (itrunc(ip)) {
+            commit_trans();
+            begin_trans();
         }
 
-        ip->flags |= I_BUSY;
-        release(&icache.lock);
-        itrunc(ip);
         ip->type = 0;
         iupdate(ip);
+        ip->flags = 0;
+        ifree(ip->inum);
 
+        releasesleep(&ip->lock);
         acquire(&icache.lock);
-        ip->flags = 0;
-        wakeup(ip);
     }
 
-    ip->ref--;
+    // keep it cached, the most recently released
+    if (--ip->ref == 0) {
+        ip->next->prev = ip->prev;
+        ip->prev->next = ip->next;
+        ip->next = icache.head.next;
+        ip->prev = &icache.head;
+        icache.head.next->prev = ip;
+        icache.head.next = ip;
+
+        if (icache.wanted) {
+            icache.wanted = 0;
+            wakeup(&icache);
+        }
+    }
+
     release(&icache.lock);
 }
 
@@ -365,82 +667,320 @@ void iunlockput (struct inode *ip)
 //
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// are listed in ip->addrs[]. The next NINDIRECT blocks are
+// listed in the indirect block ip->addrs[NDIRECT], the next
+// NINDIRECT^2 through the double indirect block addrs[NDIRECT+1],
+// and the next NINDIRECT^3 through the triple indirect block
+// addrs[NDIRECT+2]. ip->mapblk remembers the last indirect
+// block that maps data blocks, so that mapping the blocks of a
+// file in order reads one indirect block, not up to three.
+
+// Allocate a block for ip, right after block goal if possible.
+// A data block is the next one of the run writei set up, if
+// there is one left; other blocks are zeroed.
+static uint bmalloc (struct inode *ip, uint goal, int data)
+{
+    if (data && (ip->nrun > 0)) {
+        ip->nrun--;
+        return ip->run++;
+    }
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-static uint bmap (struct inode *ip, uint bn)
+    return balloc(ip->dev, goal ? goal + 1 : 0);
+}
+
+// Return entry i of indirect block addr. If it is 0 and alloc
+// is set, allocate a block for it next to the entry before: a
+// data block if data is set, an indirect block otherwise.
+static uint indirect (struct inode *ip, uint addr, uint i, int alloc, int data)
 {
-    uint addr, *a;
+    uint goal, *a;
     struct buf *bp;
 
+    bp = bread(ip->dev, addr);
+    a = (uint*) bp->data;
+
+    if ((addr = a[i]) == 0 && alloc) {
+        goal = (i > 0) ? a[i - 1] : bp->sector;
+        addr = bmalloc(ip, goal, data);
+        bmodify(bp);
+        a = (uint*) bp->data;
+        a[i] = addr;
+        log_write(bp);
+    }
+
+    brelse(bp);
+    return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, allocate one if alloc is set,
+// otherwise return 0.
+static uint bmapx (struct inode *ip, uint bn, int alloc)
+{
+    uint addr, goal, span, fbn;
+    int level;
+
+    // new blocks go right after the ones before them in the file
     if (bn < NDIRECT) {
-        if ((addr = ip->addrs[bn]) == 0) {
-            ip->addrs[bn] = addr = balloc(ip->dev);
+        if ((addr = ip->addrs[bn]) == 0 && alloc) {
+            goal = (bn > 0) ? ip->addrs[bn - 1] : 0;
+            ip->addrs[bn] = addr = bmalloc(ip, goal, 1);
         }
 
         return addr;
     }
 
+    if ((ip->mapblk != 0) && (bn - ip->mapbase < NINDIRECT)) {
+        return indirect(ip, ip->mapblk, bn - ip->mapbase, alloc, 1);
+    }
+
+    // Find the tree of indirect blocks that maps bn, and
+    // span, the number of blocks it maps.
+    fbn = bn;
     bn -= NDIRECT;
+    span = NINDIRECT;
 
-    if (bn < NINDIRECT) {
-        // Load indirect block, allocating if necessary.
-        if ((addr = ip->addrs[NDIRECT]) == 0) {
-            ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+    for (level = 0; bn >= span; level++) {
+        if (level == NLEVEL - 1) {
+            panic("bmap: out of range");
         }
 
-        bp = bread(ip->dev, addr);
-        a = (uint*) bp->data;
+        bn -= span;
+        span *= NINDIRECT;
+    }
+
+    if ((addr = ip->addrs[NDIRECT + level]) == 0) {
+        if (!alloc) {
+            return 0;
+        }
+
+        goal = ip->addrs[NDIRECT + level - 1];
+        ip->addrs[NDIRECT + level] = addr = bmalloc(ip, goal, 0);
+    }
+
+    // walk down to the indirect block that maps bn
+    for (span /= NINDIRECT; span > 1; span /= NINDIRECT) {
+        if ((addr = indirect(ip, addr, bn / span, alloc, 0)) == 0) {
+            return 0;
+        }
+
+        bn %= span;
+    }
+
+    ip->mapbase = fbn - bn;
+    ip->mapblk = addr;
+
+    return indirect(ip, addr, bn, alloc, 1);
+}
+
+static uint bmap (struct inode *ip, uint bn)
+{
+    return bmapx(ip, bn, 1);
+}
+
+// Like bmap, but never allocates: return 0 if block bn of ip
+// has no disk block.
+static uint bmap_lookup (struct inode *ip, uint bn)
+{
+    return bmapx(ip, bn, 0);
+}
+
+// Return page pn of regular file ip from the page cache, held,
+// reading it from the file's blocks if it is not cached. Return 0
+// if the cache has no room for it. Caller must hold ip->lock.
+static struct cpage* igetpage (struct inode *ip, uint pn)
+{
+    struct cpage *p;
+    uint i, addr, first;
+    uint sector[PTE_SZ / BSIZE];
+    uchar *dst[PTE_SZ / BSIZE];
+    int fresh, n;
+    uchar *d;
+
+    if (((p = pcache_get(ip, pn, &fresh)) == 0) || !fresh) {
+        return p;
+    }
+
+    // Use the disk's memory in place if it holds the blocks in a
+    // row and the buffer cache has no newer data for them.
+    first = bmap_lookup(ip, pn * (PTE_SZ / BSIZE));
+    d = first ? ideaddr(ip->dev, first + PTE_SZ / BSIZE - 1) : 0;
+
+    for (i = 0; (d != 0) && (i < PTE_SZ / BSIZE); i++) {
+        if ((bmap_lookup(ip, pn * (PTE_SZ / BSIZE) + i) != first + i) || bpending(ip->dev, first + i)) {
+            d = 0;
+        }
+    }
+
+    if (d != 0) {
+        p->data = (char*) ideaddr(ip->dev, first);
+        return p;
+    }
 
-        if ((addr = a[bn]) == 0) {
-            a[bn] = addr = balloc(ip->dev);
-            log_write(bp);
+    // read the blocks of the page together
+    for (i = 0, n = 0; i < PTE_SZ / BSIZE; i++) {
+        if ((addr = bmap_lookup(ip, pn * (PTE_SZ / BSIZE) + i)) != 0) {
+            sector[n] = addr;
+            dst[n++] = (uchar*) p->data + i * BSIZE;
+        } else {
+            memset(p->data + i * BSIZE, 0, BSIZE);
         }
+    }
+
+    breadtov(ip->dev, sector, dst, n);
+
+    return p;
+}
+
+// Start reading the blocks of ip that hold [off, off+n) into the
+// buffer cache, without waiting for them (see breadahead). Blocks
+// of a file page that is already cached, and holes, are skipped;
+// igetpage takes the blocks from the buffer cache later. Caller
+// must hold ip->lock.
+void ireadahead (struct inode *ip, uint off, uint n)
+{
+    uint bn, end, addr;
+    struct cpage *p;
+
+    if ((ip->type == T_DEV) || (off >= ip->size)) {
+        return;
+    }
+
+    if (n > ip->size - off) {
+        n = ip->size - off;
+    }
+
+    end = (off + n + BSIZE - 1) / BSIZE;
+
+    for (bn = off / BSIZE; bn < end; bn++) {
+        if ((ip->type == T_FILE) && ((p = pcache_lookup(ip, bn * BSIZE / PTE_SZ)) != 0)) {
+            pcache_put(p);
+            continue;
+        }
+
+        if ((addr = bmap_lookup(ip, bn)) != 0) {
+            breadahead(ip->dev, addr);
+        }
+    }
+}
+
+// itrunc frees a file in pieces, each in one FS operation: the
+// operation of the caller, then new ones (see iput). A piece may
+// switch bitmap blocks TRUNC_BITMAPS times; it also logs the inode,
+// an indirect block per level, and the caller's own blocks.
+#define TRUNC_BITMAPS   (MAXOPBLOCKS - NLEVEL - 4)
+
+struct trunc {
+    uint bblock;    // bitmap block of the last block freed
+    int left;       // bitmap blocks the piece may still switch to
+};
+
+// Free block b, if it fits in the piece t. Return 0 if it doesn't.
+static int tfree (struct trunc *t, int dev, uint b)
+{
+    uint bb;
+
+    bb = BBLOCK(b, fsys.sb.ninodes);
 
+    if (bb != t->bblock) {
+        if (t->left == 0) {
+            return 0;
+        }
+
+        t->left--;
+        t->bblock = bb;
+    }
+
+    bfree(dev, b);
+    return 1;
+}
+
+// Free indirect block addr and the blocks it maps, through level
+// more levels of indirect blocks, as far as the piece t goes. Return
+// 1 if all is freed; otherwise clear the entries that were, and
+// return 0.
+static int bfreeind (int dev, uint addr, int level, struct trunc *t)
+{
+    struct buf *bp;
+    uint *a;
+    int j, done;
+
+    bp = bread(dev, addr);
+    a = (uint*) bp->data;
+
+    for (j = 0; j < NINDIRECT; j++) {
+        if (a[j] == 0) {
+            continue;
+        }
+
+        if (level > 0) {
+            done = bfreeind(dev, a[j], level - 1, t);
+        } else {
+            done = tfree(t, dev, a[j]);
+        }
+
+        if (!done) {
+            break;
+        }
+    }
+
+    if ((j == NINDIRECT) && tfree(t, dev, addr)) {
         brelse(bp);
-        return addr;
+        return 1;
     }
 
-    panic("bmap: out of range");
+    bmodify(bp);
+    memset(bp->data, 0, j * sizeof(uint));
+    log_write(bp);
+    brelse(bp);
+
+    return 0;
 }
 
-// Truncate inode (discard contents).
+// Truncate inode (discard contents), or as much of it as fits in
+// one piece. Return 1 if some is left.
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
 // and has no in-memory reference to it (is
 // not an open file or current directory).
-static void itrunc (struct inode *ip)
+static int itrunc (struct inode *ip)
 {
-    int i, j;
-    struct buf *bp;
-    uint *a;
+    struct trunc t;
+    int i;
+
+    t.bblock = 0;   // not a bitmap block
+    t.left = TRUNC_BITMAPS;
+
+    pcache_drop(ip);
+    ip->mapblk = 0;
 
     for (i = 0; i < NDIRECT; i++) {
         if (ip->addrs[i]) {
-            bfree(ip->dev, ip->addrs[i]);
+            if (!tfree(&t, ip->dev, ip->addrs[i])) {
+                goto more;
+            }
+
             ip->addrs[i] = 0;
         }
     }
 
-    if (ip->addrs[NDIRECT]) {
-        bp = bread(ip->dev, ip->addrs[NDIRECT]);
-        a = (uint*) bp->data;
-
-        for (j = 0; j < NINDIRECT; j++) {
-            if (a[j]) {
-                bfree(ip->dev, a[j]);
+    for (i = 0; i < NLEVEL; i++) {
+        if (ip->addrs[NDIRECT + i]) {
+            if (!bfreeind(ip->dev, ip->addrs[NDIRECT + i], i, &t)) {
+                goto more;
             }
-        }
 
-        brelse(bp);
-        bfree(ip->dev, ip->addrs[NDIRECT]);
-        ip->addrs[NDIRECT] = 0;
+            ip->addrs[NDIRECT + i] = 0;
+        }
     }
 
     ip->size = 0;
     iupdate(ip);
+    return 0;
+
+    more:
+    iupdate(ip);
+    return 1;
 }
 
 // Copy stat information from inode.
@@ -459,6 +999,7 @@ int readi (struct inode *ip, char *dst, uint off, uint n)
 {
     uint tot, m;
     struct buf *bp;
+    struct cpage *p;
 
     if (ip->type == T_DEV) {
         if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read) {
@@ -477,6 +1018,14 @@ int readi (struct inode *ip, char *dst, uint off, uint n)
     }
 
     for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+        // file data comes from the page cache if it has room
+        if ((ip->type == T_FILE) && ((p = igetpage(ip, off / PTE_SZ)) != 0)) {
+            m = min(n - tot, PTE_SZ - off%PTE_SZ);
+            memmove(dst, p->data + off % PTE_SZ, m);
+            pcache_put(p);
+            continue;
+        }
+
         bp = bread(ip->dev, bmap(ip, off / BSIZE));
         m = min(n - tot, BSIZE - off%BSIZE);
         memmove(dst, bp->data + off % BSIZE, m);
@@ -490,8 +1039,9 @@ int readi (struct inode *ip, char *dst, uint off, uint n)
 // Write data to inode.
 int writei (struct inode *ip, char *src, uint off, uint n)
 {
-    uint tot, m;
+    uint tot, m, bn, first, end, got;
     struct buf *bp;
+    struct cpage *p;
 
     if (ip->type == T_DEV) {
         if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write) {
@@ -509,12 +1059,45 @@ int writei (struct inode *ip, char *src, uint off, uint n)
         return -1;
     }
 
+    // The blocks in [first, end) are added to the file and written
+    // in full. Allocate them together, as one run if there is room,
+    // and neither zero nor read them.
+    first = (ip->size + BSIZE - 1) / BSIZE;
+    end = (off + n) / BSIZE;
+    got = 0;
+
+    if (end > first) {
+        bn = (first > 0) ? bmap_lookup(ip, first - 1) : 0;
+        ip->run = brun(ip->dev, bn ? bn + 1 : 0, end - first, &got);
+        ip->nrun = got;
+    }
+
     for (tot = 0; tot < n; tot += m, off += m, src += m) {
-        bp = bread(ip->dev, bmap(ip, off / BSIZE));
+        bn = off / BSIZE;
         m = min(n - tot, BSIZE - off%BSIZE);
+
+        if ((bn >= first) && (bn < first + got)) {
+            bp = bnew(ip->dev, bmap(ip, bn));
+        } else {
+            bp = bread(ip->dev, bmap(ip, bn));
+            bmodify(bp);
+        }
+
         memmove(bp->data + off % BSIZE, src, m);
         log_write(bp);
         brelse(bp);
+
+        // keep a cached page the same as the file
+        if ((ip->type == T_FILE) && ((p = pcache_lookup(ip, off / PTE_SZ)) != 0)) {
+            pcache_modify(p);
+            memmove(p->data + off % PTE_SZ, src, m);
+            pcache_put(p);
+        }
+    }
+
+    // give back what bmap did not use
+    for (; ip->nrun > 0; ip->nrun--) {
+        bfree(ip->dev, ip->run++);
     }
 
     if (n > 0 && off > ip->size) {
@@ -533,44 +1116,231 @@ int namecmp (const char *s, const char *t)
     return strncmp(s, t, DIRSIZ);
 }
 
+// A directory is an array of dirents. Once a directory outgrows
+// its first block, it is indexed instead: block 0 holds a hash
+// index (see fs.h) and the entries live in leaf blocks. Slot
+// dirhash(name) % 2^depth of the index gives the leaf for name.
+// A full leaf is split in two, doubling the index if needed
+// (extendible hashing), so a lookup or insert reads two blocks
+// however large the directory grows.
+
+// Is bp, the first block of a directory, an index?
+static int dxindexed (struct buf *bp)
+{
+    ushort *u;
+
+    u = (ushort*) bp->data;
+    return (u[0] == 0) && (u[1] == DX_MAGIC);
+}
+
+// Set [*from, *to) to the part of directory dp that holds name,
+// if it is there: its leaf block if dp is indexed, all of it
+// otherwise. Return 1 if dp is indexed.
+static int dirrange (struct inode *dp, char *name, uint *from, uint *to)
+{
+    struct buf *bp;
+    ushort *u;
+    int indexed;
+
+    *from = 0;
+    *to = dp->size;
+
+    if (dp->size == 0) {
+        return 0;
+    }
+
+    bp = bread(dp->dev, bmap(dp, 0));
+    u = (ushort*) bp->data;
+
+    if ((indexed = dxindexed(bp)) != 0) {
+        *from = u[DX_SLOT(dirhash(name) & ((1 << u[2]) - 1))] * BSIZE;
+        *to = *from + BSIZE;
+    }
+
+    brelse(bp);
+    return indexed;
+}
+
+// Look for name in the entries of dp in [from, to), or for a free
+// entry if name is 0. Return its offset, and set *pinum to its
+// inode number. Return to if there is none.
+static uint dirscan (struct inode *dp, char *name, uint from, uint to, uint *pinum)
+{
+    struct buf *bp;
+    struct dirent *de;
+    uint off;
+
+    off = from;
+
+    while (off < to) {
+        bp = bread(dp->dev, bmap(dp, off / BSIZE));
+
+        do {
+            de = (struct dirent*) (bp->data + off % BSIZE);
+
+            if ((name == 0) ? (de->inum == 0)
+                    : ((de->inum != 0) && (namecmp(name, de->name) == 0))) {
+                *pinum = de->inum;
+                brelse(bp);
+                return off;
+            }
+
+            off += sizeof(*de);
+        } while ((off < to) && (off % BSIZE != 0));
+
+        brelse(bp);
+    }
+
+    return to;
+}
+
+// Turn dp, a directory with one full block of entries, into an
+// indexed directory whose only leaf holds the entries.
+static void dxconvert (struct inode *dp)
+{
+    struct buf *ib, *lb;
+    ushort *u;
+
+    ib = bread(dp->dev, bmap(dp, 0));
+    lb = bread(dp->dev, bmap(dp, 1));
+    bmodify(ib);
+    bmodify(lb);
+
+    memmove(lb->data, ib->data, BSIZE);
+    memset(ib->data, 0, BSIZE);
+
+    u = (ushort*) ib->data;
+    u[1] = DX_MAGIC;
+    u[2] = 0;
+    u[DX_SLOT(0)] = 1;
+
+    log_write(lb);
+    log_write(ib);
+    brelse(lb);
+    brelse(ib);
+
+    dp->size = 2 * BSIZE;
+    iupdate(dp);
+
+    dcache_purge(dp->dev, dp->inum);  // the entries have moved
+}
+
+// Make room in the leaf of the indexed directory dp that name
+// hashes to, by moving half of its entries to a new leaf.
+// Return -1 if the index can't grow any more.
+static int dxsplit (struct inode *dp, char *name)
+{
+    struct buf *ib, *ob, *nb;
+    struct dirent *de, *ne;
+    ushort *u, old, new;
+    uint depth, ld, bit, i, n;
+
+    ib = bread(dp->dev, bmap(dp, 0));
+    bmodify(ib);
+    u = (ushort*) ib->data;
+    depth = u[2];
+    old = u[DX_SLOT(dirhash(name) & ((1 << depth) - 1))];
+
+    // 2^(depth - ld) slots point to a leaf of local depth ld
+    for (n = 0, i = 0; i < (1 << depth); i++) {
+        if (u[DX_SLOT(i)] == old) {
+            n++;
+        }
+    }
+
+    for (ld = depth; n > 1; n >>= 1) {
+        ld--;
+    }
+
+    if (ld == depth) {
+        if (depth == DX_MAXDEPTH) {
+            brelse(ib);
+            return -1;
+        }
+
+        // double the index
+        for (i = 0; i < (1 << depth); i++) {
+            u[DX_SLOT(i + (1 << depth))] = u[DX_SLOT(i)];
+        }
+
+        u[2] = ++depth;
+    }
+
+    // names with bit ld set in their hash go to the new leaf
+    new = dp->size / BSIZE;
+    bit = 1 << ld;
+
+    for (i = 0; i < (1 << depth); i++) {
+        if ((u[DX_SLOT(i)] == old) && (i & bit)) {
+            u[DX_SLOT(i)] = new;
+        }
+    }
+
+    ob = bread(dp->dev, bmap(dp, old));
+    nb = bread(dp->dev, bmap(dp, new));
+    bmodify(ob);
+    bmodify(nb);
+    ne = (struct dirent*) nb->data;
+
+    for (de = (struct dirent*) ob->data; de < (struct dirent*) (ob->data + BSIZE); de++) {
+        if ((de->inum != 0) && (dirhash(de->name) & bit)) {
+            *ne++ = *de;
+            memset(de, 0, sizeof(*de));
+        }
+    }
+
+    log_write(nb);
+    log_write(ob);
+    log_write(ib);
+    brelse(nb);
+    brelse(ob);
+    brelse(ib);
+
+    dp->size += BSIZE;
+    iupdate(dp);
+
+    dcache_purge(dp->dev, dp->inum);  // the entries have moved
+    return 0;
+}
+
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode* dirlookup (struct inode *dp, char *name, uint *poff)
 {
-    uint off, inum;
-    struct dirent de;
+    uint off, inum, from, to;
 
     if (dp->type != T_DIR) {
         panic("dirlookup not DIR");
     }
 
-    for (off = 0; off < dp->size; off += sizeof(de)) {
-        if (readi(dp, (char*) &de, off, sizeof(de)) != sizeof(de)) {
-            panic("dirlink read");
-        }
+    if (!dcache_lookup(dp->dev, dp->inum, name, &inum, &off)) {
+        dirrange(dp, name, &from, &to);
 
-        if (de.inum == 0) {
-            continue;
+        if ((off = dirscan(dp, name, from, to, &inum)) == to) {
+            inum = 0;
         }
 
-        if (namecmp(name, de.name) == 0) {
-            // entry matches path element
-            if (poff) {
-                *poff = off;
-            }
+        dcache_enter(dp->dev, dp->inum, name, inum, off);
+    }
 
-            inum = de.inum;
-            return iget(dp->dev, inum);
-        }
+    if (inum == 0) {
+        return 0;
     }
 
-    return 0;
+    // entry matches path element
+    if (poff) {
+        *poff = off;
+    }
+
+    return iget(dp->dev, inum);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
+// Return -1 if name is present, or the directory is full.
 int dirlink (struct inode *dp, char *name, uint inum)
 {
-    int off;
+    uint off, from, to, x;
     struct dirent de;
     struct inode *ip;
 
@@ -580,14 +1350,26 @@ int dirlink (struct inode *dp, char *name, uint inum)
         return -1;
     }
 
-    // Look for an empty dirent.
-    for (off = 0; off < dp->size; off += sizeof(de)) {
-        if (readi(dp, (char*) &de, off, sizeof(de)) != sizeof(de)) {
-            panic("dirlink read");
-        }
+    // Look for an empty dirent where name belongs.
+    for (;;) {
+        if (dirrange(dp, name, &from, &to)) {
+            if ((off = dirscan(dp, 0, from, to, &x)) < to) {
+                break;
+            }
 
-        if (de.inum == 0) {
-            break;
+            if (dxsplit(dp, name) < 0) {
+                return -1;
+            }
+
+        } else {
+            // a small directory grows by one entry, a full one
+            // is indexed. Directories of more than one block
+            // that are not indexed only grow.
+            if (((off = dirscan(dp, 0, from, to, &x)) < to) || (dp->size != BSIZE)) {
+                break;
+            }
+
+            dxconvert(dp);
         }
     }
 
@@ -598,9 +1380,71 @@ int dirlink (struct inode *dp, char *name, uint inum)
         panic("dirlink");
     }
 
+    dcache_enter(dp->dev, dp->inum, name, inum, off);
     return 0;
 }
 
+// Read up to n entries of directory dp, starting at offset *off,
+// into ds, each with the attributes of its inode. Empty entries,
+// which include the index of an indexed directory, are skipped.
+// Advance *off past the entries read and return their number.
+// dp must not be locked.
+int dirread (struct inode *dp, uint *off, struct dirstat *ds, int n)
+{
+    struct dirent de;
+    struct inode *ip, *pp;
+    int i, pi;
+
+    pp = 0;
+    pi = 0;
+
+    ilock(dp);
+
+    if (dp->type != T_DIR) {
+        iunlock(dp);
+        return -1;
+    }
+
+    for (i = 0; (i < n) && (*off + sizeof(de) <= dp->size); *off += sizeof(de)) {
+        if (readi(dp, (char*) &de, *off, sizeof(de)) != sizeof(de)) {
+            panic("dirread");
+        }
+
+        if (de.inum == 0) {
+            continue;
+        }
+
+        memmove(ds[i].name, de.name, DIRSIZ);
+
+        if (de.inum == dp->inum) {
+            stati(dp, &ds[i].st);
+
+        } else if (namecmp(de.name, "..") == 0) {
+            // the parent is locked after dp is released, as in namex
+            pp = iget(dp->dev, de.inum);
+            pi = i;
+
+        } else {
+            ip = iget(dp->dev, de.inum);
+            ilock(ip);
+            stati(ip, &ds[i].st);
+            iunlockput(ip);
+        }
+
+        i++;
+    }
+
+    iunlock(dp);
+
+    if (pp != 0) {
+        ilock(pp);
+        stati(pp, &ds[pi].st);
+        iunlockput(pp);
+    }
+
+    return i;
+}
+
 //PAGEBREAK!
 // Paths
 
@@ -7,9 +7,15 @@
 // Then free bitmap blocks holding sb.size bits.
 // Then sb.nblocks data blocks.
 // Then sb.nlog log blocks.
+// The sb.nswap swap blocks follow the file system (not in sb.size).
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+
+// Block size: 512, 1024, 2048 or 4096 bytes, chosen when the kernel
+// and mkfs are built (make BSIZE=...) and recorded in sb.bsize.
+#ifndef BSIZE
+#define BSIZE 512
+#endif
 
 // File system super block
 struct superblock {
@@ -17,11 +23,14 @@ struct superblock {
     uint    nblocks;        // Number of data blocks
     uint    ninodes;        // Number of inodes.
     uint    nlog;           // Number of log blocks
+    uint    nswap;          // Number of swap blocks after the file system
+    uint    bsize;          // Block size (BSIZE)
 };
 
-#define NDIRECT 12
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NLEVEL 3    // single, double and triple indirect blocks
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT + NINDIRECT*NINDIRECT*NINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -30,7 +39,7 @@ struct dinode {
     short   minor;          // Minor device number (T_DEV only)
     short   nlink;          // Number of links to inode in file system
     uint    size;           // Size of file (bytes)
-    uint    addrs[NDIRECT+1]; // Data block addresses
+    uint    addrs[NDIRECT+NLEVEL]; // Data block addresses
 };
 
 // Inodes per block.
@@ -53,3 +62,35 @@ struct dirent {
     char    name[DIRSIZ];
 };
 
+// Directory entries per block.
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// A directory larger than one block is indexed: its first block is
+// a hash index of leaf blocks holding the entries (see fs.c). Seen
+// as an array of ushort, the index block holds DX_MAGIC at [1], the
+// depth at [2] and slot i at DX_SLOT(i), so that it reads as free
+// dirents: the first ushort of every 16 bytes is 0.
+#define DX_MAGIC      0xd1d1
+#define DX_MAXDEPTH   7
+#define DX_SLOT(i)    (8 * (1 + (i) / 7) + 1 + (i) % 7)
+
+// Log blocks reserved by an operation that adds a directory entry.
+// The insert may split leaves up to DX_MAXDEPTH times, and each split
+// logs a new leaf on top of what MAXOPBLOCKS covers.
+#define DX_OPBLOCKS   (MAXOPBLOCKS + DX_MAXDEPTH)
+
+// Hash of a directory entry name (FNV-1a).
+static inline uint dirhash (char *name)
+{
+    uint h;
+    int i;
+
+    h = 2166136261;
+
+    for (i = 0; (i < DIRSIZ) && (name[i] != 0); i++) {
+        h = (h ^ (uchar) name[i]) * 16777619;
+    }
+
+    return h;
+}
+
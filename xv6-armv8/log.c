@@ -1,22 +1,32 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
-// Simple logging. Each system call that might write the file system
-// should be surrounded with begin_trans() and commit_trans() calls.
+// Simple logging with group commit. Each system call that might
+// write the file system should be surrounded with begin_trans() and
+// commit_trans() calls.
 //
-// The log holds at most one transaction at a time. Commit forces
-// the log (with commit record) to disk, then installs the affected
-// blocks to disk, then erases the log. begin_trans() ensures that
-// only one system call can be in a transaction; others must wait.
+// Many FS operations can be in the open transaction at once. Each
+// one reserves MAXOPBLOCKS blocks of log space in begin_trans() (or
+// more, with begin_trans_n()), and waits if the log can't take that
+// many more. The transaction is committed as a group when the last
+// operation in it ends and the log is full, the transaction is
+// LOG_AGE ticks old, or someone asked for it with log_sync().
+// Operations don't need to worry about each other: a block modified
+// by one is simply absorbed into the transaction, and nothing is
+// committed while any is running.
 //
-// Allowing only one transaction at a time means that the file
-// system code doesn't have to worry about the possibility of
-// one transaction reading a block that another one has modified,
-// for example an i-node block.
+// Commit forces the log (with commit record) to disk, then installs
+// the affected blocks: they are still in the buffer cache, so
+// installing only hands them to the flusher as delayed writes. The
+// log is reused when the next transaction starts: the installed
+// blocks are written back first (a checkpoint).
 //
 // Read-only system calls don't need to use transactions, though
 // this means that they may observe uncommitted data. I-node and
@@ -24,58 +34,103 @@
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing sector #s for block A, B, C, ...
+//   header blocks, containing the count and sector #s for
+//     block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The size of the log comes from the superblock. The first header
+// block holds the count and as many sector #s as fit; the others
+// continue the list.
+//
+// The first header block is the commit record. It carries a sequence
+// number and a checksum of the whole transaction: header and log
+// blocks. Recovery only replays a log whose checksum matches, so the
+// header and the log blocks can go to disk in any order, and the log
+// never has to be erased: a commit that didn't reach the disk in full,
+// or a log partly overwritten by the next one, doesn't match.
+
+// Contents of a header block.
+#define LOGHDR      ((BSIZE - 3 * sizeof(int)) / sizeof(int))
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged sector #s before commit.
 struct logheader {
-    int n;
-    int sector[LOGSIZE];
+    int n;              // sectors in the log (first header block only)
+    uint seq;           // sequence number of the transaction
+    uint cksum;         // checksum of the transaction
+    int sector[LOGHDR];
 };
 
+#define LOG_AGE     HZ  // commit a transaction at most this old
+#define LOG_BATCH   32  // log blocks written at once
+
 struct log {
     struct spinlock lock;
     int start;
     int size;
-    int busy; // a transaction is active
+    int nhead;          // header blocks at the start of the log
+    int cap;            // data blocks: the most one transaction can log
+    int outstanding;    // FS operations in the open transaction
+    int reserved;       // log blocks reserved by those operations
+    int committing;     // in commit or checkpoint, please wait
+    int forced;         // commit when the running operations end
+    int installed;      // the log on disk holds a committed transaction
+    uint ncommit;       // number of commits so far
+    uint opened;        // ticks when the open transaction began
     int dev;
-    struct logheader lh;
+    uint seq;           // sequence number of the last commit
+    int n;              // sectors logged so far
+    int *sector;        // their sector #s, cap of them
 };
 struct log log;
 
 static void recover_from_log(void);
+static void commit(void);
+static int force_commit(void);
 
 void initlog(void)
 {
     struct superblock sb;
 
-    if (sizeof(struct logheader) >= BSIZE) {
+    if (sizeof(struct logheader) > BSIZE) {
         panic("initlog: too big logheader");
     }
 
     initlock(&log.lock, "log");
     readsb(ROOTDEV, &sb);
+
     log.start = sb.size - sb.nlog;
     log.size = sb.nlog;
+    log.nhead = (log.size + LOGHDR) / (LOGHDR + 1);
+    log.cap = log.size - log.nhead;
     log.dev = ROOTDEV;
+
+    if (log.cap < MAXOPBLOCKS) {
+        panic("initlog: log too small");
+    }
+
+    if (log.nhead > LOG_BATCH) {
+        panic("initlog: log too big");
+    }
+
+    if ((log.sector = kmalloc(get_order(log.cap * sizeof(int)))) == NULL) {
+        panic("initlog: no memory");
+    }
+
     recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location,
+// when recovering after a crash.
 static void install_trans(void)
 {
     int tail;
     struct buf *lbuf;
     struct buf *dbuf;
 
-    for (tail = 0; tail < log.lh.n; tail++) {
-        lbuf = bread(log.dev, log.start+tail+1); // read log block
-        dbuf = bread(log.dev, log.lh.sector[tail]); // read dst
+    for (tail = 0; tail < log.n; tail++) {
+        lbuf = bread(log.dev, log.start+log.nhead+tail); // read log block
+        dbuf = bnew(log.dev, log.sector[tail]); // dst, overwritten
 
         memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
 
@@ -85,120 +140,396 @@ static void install_trans(void)
     }
 }
 
-// Read the log header from disk into the in-memory log header
-static void read_head(void)
+// Checksum n bytes (a multiple of 4) at p, continuing from sum:
+// FNV-1a over 32-bit words.
+static uint cksum (uint sum, void *p, int n)
+{
+    uint *w;
+
+    for (w = p; n > 0; w++, n -= sizeof(uint)) {
+        sum = (sum ^ *w) * 16777619;
+    }
+
+    return sum;
+}
+
+// Start the checksum of the transaction in the in-memory log header.
+static uint head_cksum(void)
+{
+    uint sum;
+
+    sum = cksum(2166136261, &log.seq, sizeof(log.seq));
+    sum = cksum(sum, &log.n, sizeof(log.n));
+
+    return cksum(sum, log.sector, log.n * sizeof(int));
+}
+
+// Read the log header from disk into the in-memory log header.
+// Return the checksum recorded in it.
+static uint read_head(void)
 {
     struct buf *buf;
     struct logheader *lh;
-    int i;
+    uint sum;
+    int h, i;
 
     buf = bread(log.dev, log.start);
     lh = (struct logheader *) (buf->data);
-    log.lh.n = lh->n;
+    log.n = lh->n;
+    log.seq = lh->seq;
+    sum = lh->cksum;
+
+    if ((log.n < 0) || (log.n > log.cap)) {
+        log.n = 0;  // can't be ours, doesn't check out
+    }
 
-    for (i = 0; i < log.lh.n; i++) {
-        log.lh.sector[i] = lh->sector[i];
+    for (h = 0, i = 0; i < log.n; i++) {
+        if (i == (h + 1) * LOGHDR) {
+            brelse(buf);
+            buf = bread(log.dev, log.start + ++h);
+            lh = (struct logheader *) (buf->data);
+        }
+
+        log.sector[i] = lh->sector[i - h * LOGHDR];
     }
 
     brelse(buf);
+    return sum;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void write_head(void)
+// Does the transaction read by read_head match its checksum?
+static int log_valid(uint sum)
 {
-    struct buf *buf;
-    struct logheader *hb;
+    struct buf *lbuf;
+    uint s;
     int i;
 
-    buf = bread(log.dev, log.start);
-    hb = (struct logheader *) (buf->data);
+    s = head_cksum();
+
+    for (i = 0; i < log.n; i++) {
+        lbuf = bread(log.dev, log.start+log.nhead+i);
+        s = cksum(s, lbuf->data, BSIZE);
+        brelse(lbuf);
+    }
+
+    return s == sum;
+}
 
-    hb->n = log.lh.n;
+// Write the in-memory log header to disk, with checksum sum.
+// The header blocks are whole-block writes, so they are not read
+// first. Writing them is the true point at which the current
+// transaction commits.
+static void write_head(uint sum)
+{
+    struct buf *hbuf[LOG_BATCH];
+    struct logheader *hb;
+    int h, i, nh;
 
-    for (i = 0; i < log.lh.n; i++) {
-        hb->sector[i] = log.lh.sector[i];
+    nh = (log.n + LOGHDR - 1) / LOGHDR;
+
+    for (h = 0; h < nh; h++) {
+        hbuf[h] = bnew(log.dev, log.start + h);
+        hb = (struct logheader *) (hbuf[h]->data);
+        hb->n = (h == 0) ? log.n : 0;
+        hb->seq = log.seq;
+        hb->cksum = (h == 0) ? sum : 0;
+
+        for (i = h * LOGHDR; (i < log.n) && (i < (h + 1) * LOGHDR); i++) {
+            hb->sector[i - h * LOGHDR] = log.sector[i];
+        }
     }
 
-    bwrite(buf);
-    brelse(buf);
+    bwritev(hbuf, nh);
+
+    for (h = 0; h < nh; h++) {
+        brelse(hbuf[h]);
+    }
 }
 
 static void recover_from_log(void)
 {
-    read_head();
-    install_trans(); // if committed, copy from log to disk
-    log.lh.n = 0;
-    write_head(); // clear the log
+    uint sum;
+
+    sum = read_head();
+
+    if ((log.n > 0) && log_valid(sum)) {
+        install_trans(); // if committed, copy from log to disk
+    }
+
+    log.n = 0;
 }
 
-void begin_trans(void)
+// Write the blocks of the last committed transaction back to
+// their home locations, before the log is reused.
+static void checkpoint(void)
 {
+    bsync();
+}
+
+// Start an FS operation that writes at most nblocks blocks.
+void begin_trans_n(int nblocks)
+{
+    if (nblocks > log.cap) {
+        panic("begin_trans: too big a transaction");
+    }
+
     acquire(&log.lock);
 
-    while (log.busy) {
-        sleep(&log, &log.lock);
+    for (;;) {
+        if (log.committing || log.forced) {
+            sleep(&log, &log.lock);
+
+        } else if (log.n + log.reserved + nblocks > log.cap) {
+            // this op might run out of log space; wait for the
+            // others to end, and the transaction to commit. If
+            // none is running, no one else will commit it.
+            if ((log.outstanding == 0) && force_commit()) {
+                release(&log.lock);
+                commit();
+                acquire(&log.lock);
+            } else {
+                sleep(&log, &log.lock);
+            }
+
+        } else if ((log.outstanding == 0) && (log.n == 0) && log.installed) {
+            // the log is about to be reused. Checkpoint before any
+            // block of the committed transaction is modified again.
+            log.committing = 1;
+            release(&log.lock);
+
+            checkpoint();
+
+            acquire(&log.lock);
+            log.installed = 0;
+            log.committing = 0;
+            wakeup(&log);
+
+        } else {
+            if ((log.outstanding == 0) && (log.n == 0)) {
+                log.opened = ticks;
+            }
+
+            log.outstanding++;
+            log.reserved += nblocks;
+            proc->logresv = nblocks;
+            break;
+        }
     }
 
-    log.busy = 1;
     release(&log.lock);
 }
 
-void commit_trans(void)
+void begin_trans(void)
+{
+    begin_trans_n(MAXOPBLOCKS);
+}
+
+// The most blocks a single operation may reserve. Leave room for
+// others to run at the same time.
+int log_maxblocks(void)
+{
+    return log.cap / 2;
+}
+
+// Copy the blocks of the transaction from the cache to the log,
+// and write them to disk LOG_BATCH blocks at a time. Return the
+// checksum of the transaction.
+static uint write_log(void)
+{
+    struct buf *lbuf[LOG_BATCH];
+    struct buf *dbuf;
+    uint sum;
+    int i, j, n;
+
+    sum = head_cksum();
+
+    for (i = 0; i < log.n; i += n) {
+        n = log.n - i;
+
+        if (n > LOG_BATCH) {
+            n = LOG_BATCH;
+        }
+
+        for (j = 0; j < n; j++) {
+            dbuf = bread(log.dev, log.sector[i+j]);  // pinned, in the cache
+            lbuf[j] = bnew(log.dev, log.start+log.nhead+i+j);
+            memmove(lbuf[j]->data, dbuf->data, BSIZE);
+            brelse(dbuf);
+            sum = cksum(sum, lbuf[j]->data, BSIZE);
+        }
+
+        bwritev(lbuf, n);
+
+        for (j = 0; j < n; j++) {
+            brelse(lbuf[j]);
+        }
+    }
+
+    return sum;
+}
+
+// Unpin the blocks of the committed transaction, and let the
+// flusher write them to their home locations.
+static void install_cached(void)
 {
-    if (log.lh.n > 0) {
-        write_head();    // Write header to disk -- the real commit
-        install_trans(); // Now install writes to home locations
-        log.lh.n = 0;
-        write_head();    // Erase the transaction from the log
+    struct buf *b;
+    int i;
+
+    for (i = 0; i < log.n; i++) {
+        b = bread(log.dev, log.sector[i]);
+        b->flags &= ~B_LOGGED;
+        bdwrite(b);
+        brelse(b);
     }
+}
+
+// Commit the transaction. The caller has set log.committing,
+// so no operation is running and none can start.
+static void commit(void)
+{
+    uint sum;
+
+    if (log.n > 0) {
+        log.seq++;
+        sum = write_log();      // Write the log blocks
+        write_head(sum);        // Write header to disk -- the real commit
+        install_cached();       // Now install writes to home locations
+        log.installed = 1;
+    }
+
+    acquire(&log.lock);
+    log.n = 0;
+    log.committing = 0;
+    log.forced = 0;
+    log.ncommit++;
+    wakeup(&log);
+    release(&log.lock);
+}
+
+// Ask for the open transaction to be committed. Return 1 if the
+// caller should commit it right away; otherwise the last running
+// operation will. Caller holds log.lock.
+static int force_commit(void)
+{
+    log.forced = 1;
+
+    if ((log.outstanding > 0) || log.committing) {
+        return 0;
+    }
+
+    log.committing = 1;
+    return 1;
+}
+
+void commit_trans(void)
+{
+    int docommit;
 
     acquire(&log.lock);
-    log.busy = 0;
+
+    if ((log.outstanding < 1) || log.committing) {
+        panic("commit_trans");
+    }
+
+    log.outstanding--;
+    log.reserved -= proc->logresv;
+    proc->logresv = 0;
+    docommit = 0;
+
+    if ((log.outstanding == 0) && (log.forced
+            || (log.n + MAXOPBLOCKS > log.cap)
+            || (ticks - log.opened >= LOG_AGE))) {
+        log.committing = 1;
+        docommit = 1;
+    }
+
+    // begin_trans() may be waiting for log space
     wakeup(&log);
     release(&log.lock);
+
+    if (docommit) {
+        commit();
+    }
 }
 
 // Caller has modified b->data and is done with the buffer.
-// Append the block to the log and record the block number,
-// but don't write the log header (which would commit the write).
-// log_write() replaces bwrite(); a typical use is:
+// Record the block number and pin the buffer in the cache until
+// the transaction commits; commit copies it to the log. Nothing is
+// written now, so modifying the block again in the same transaction
+// costs nothing. log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
+//   bmodify(bp)
 //   modify bp->data[]
 //   log_write(bp)
 //   brelse(bp)
 void log_write(struct buf *b)
 {
-    struct buf *lbuf;
-    int i;
+    if (b->flags & B_ALIAS) {
+        panic("log_write: bmodify not called");
+    }
+
+    if (b->flags & B_LOGGED) { // log absorbtion
+        return;
+    }
 
-    if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1) {
+    acquire(&log.lock);
+
+    if (log.n >= log.cap) {
         panic("too big a transaction");
     }
 
-    if (!log.busy) {
+    if (log.outstanding < 1) {
         panic("write outside of trans");
     }
 
-    for (i = 0; i < log.lh.n; i++) {
-        if (log.lh.sector[i] == b->sector) { // log absorbtion?
-            break;
-        }
+    log.sector[log.n++] = b->sector;
+    release(&log.lock);
+
+    b->flags |= B_LOGGED; // pin in the cache until commit
+}
+
+// Commit the open transaction if it has been open for LOG_AGE
+// ticks. Called periodically by the flusher.
+void log_age(void)
+{
+    int docommit;
+
+    acquire(&log.lock);
+    docommit = 0;
+
+    if ((log.n > 0) && !log.forced && !log.committing
+            && (ticks - log.opened >= LOG_AGE)) {
+        docommit = force_commit();
     }
 
-    log.lh.sector[i] = b->sector;
-    lbuf = bread(b->dev, log.start+i+1);
+    release(&log.lock);
+
+    if (docommit) {
+        commit();
+    }
+}
 
-    memmove(lbuf->data, b->data, BSIZE);
-    bwrite(lbuf);
-    brelse(lbuf);
+// Commit everything done so far, and write it back to its
+// home location.
+void log_sync(void)
+{
+    uint n;
 
-    if (i == log.lh.n) {
-        log.lh.n++;
+    acquire(&log.lock);
+    n = log.ncommit;
+
+    while (log.ncommit == n) {
+        if (force_commit()) {
+            release(&log.lock);
+            commit();
+            acquire(&log.lock);
+        } else {
+            sleep(&log, &log.lock);
+        }
     }
 
-    b->flags |= B_DIRTY; // XXX prevent eviction
+    release(&log.lock);
+    bsync();
 }
 
 //PAGEBREAK!
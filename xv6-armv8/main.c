@@ -37,11 +37,11 @@ void kmain (void)
     binit ();					// buffer cache
     fileinit ();				// file table
     iinit ();					// inode cache
+    dcacheinit ();				// directory entry cache
+    pcacheinit ();				// page cache
     ideinit ();					// ide (memory block device)
 
-#ifdef INCLUDE_REMOVED
     timer_init (HZ);				// the timer (ticker)
-#endif
 
     sti ();
     userinit();					// first user process
@@ -1,5 +1,8 @@
-// Fake IDE disk; stores blocks in memory.
-// Useful for running kernel without scratch disk.
+// Block devices. The disks are the virtio disks QEMU is given (see
+// device/virtio.c), numbered from 1. Without any, disk 1 is a fake
+// IDE disk that stores blocks of BSIZE bytes in memory: the file
+// system image linked into the kernel, whose changes are lost at
+// reboot. Useful for running kernel without scratch disk.
 
 #include "types.h"
 #include "defs.h"
@@ -7,18 +10,23 @@
 #include "mmu.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "buf.h"
+#include "fs.h"
 
 // a file system image, embeded
 extern uchar _binary_fs_img_start[], _binary_fs_img_size[];
 
 static long disksize;
 static uchar *memdisk;
+static int nvdisk;  // virtio disks, or 0 for the memory disk
 
 void ideinit(void)
 {
     memdisk = _binary_fs_img_start;
-    disksize = (uint64)_binary_fs_img_size/512;
+    disksize = (uint64)_binary_fs_img_size/BSIZE;
+
+    nvdisk = virtio_init();
 }
 
 // Interrupt handler.
@@ -27,37 +35,129 @@ void ideintr(void)
     // no-op
 }
 
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
-void iderw(struct buf *b)
+// The memory disk keeps its blocks in memory already. Return the
+// address of sector, so that bread can use the block in place, or 0
+// if it can't. The memory must not be written but through iderw.
+uchar* ideaddr(uint dev, uint sector)
 {
-    uchar *p;
+    if((nvdisk > 0) || (dev != 1) || (sector >= disksize)) {
+        return 0;
+    }
+
+    return memdisk + sector*BSIZE;
+}
 
-    if(!(b->flags & B_BUSY)) {
-        panic("iderw: buf not busy");
+// Check that b is a request the disks can take.
+static void idecheck(struct buf *b)
+{
+    if(!holdingsleep(&b->lock)) {
+        panic("iderw: buf not locked");
     }
 
     if((b->flags & (B_VALID|B_DIRTY)) == B_VALID) {
         panic("iderw: nothing to do");
     }
 
-    if(b->dev != 1) {
-        panic("iderw: request not for disk 1");
+    if((b->dev < 1) || (b->dev > (nvdisk > 0 ? nvdisk : 1))) {
+        panic("iderw: no such disk");
+    }
+
+    if(b->sector >= (nvdisk > 0 ? virtio_size(b->dev) : disksize)) {
+        panic("iderw: block out of range");
     }
+}
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// A virtio disk does it while we sleep, with other requests in
+// flight; the memory disk copies the block at once.
+void iderw(struct buf *b)
+{
+    uchar *p;
+
+    idecheck(b);
 
-    if(b->sector >= disksize) {
-        panic("iderw: sector out of range");
+    if(nvdisk > 0) {
+        virtio_start(b, 1);
+        virtio_wait(b);
+        return;
     }
 
-    p = memdisk + b->sector*512;
+    p = memdisk + b->sector*BSIZE;
 
     if(b->flags & B_DIRTY){
         b->flags &= ~B_DIRTY;
-        memmove(p, b->data, 512);
+
+        if(b->data != p) {
+            memmove(p, b->data, BSIZE);
+        }
     } else {
-        memmove(b->data, p, 512);
+        memmove(b->data, p, BSIZE);
     }
 
     b->flags |= B_VALID;
 }
+
+// Start reading b, and return without waiting for the disk: the
+// buffer may be released with the read in flight (B_DISK), and
+// idewait waits for it. The memory disk reads it at once.
+void idestart(struct buf *b)
+{
+    if(nvdisk == 0) {
+        iderw(b);
+        return;
+    }
+
+    idecheck(b);
+
+    if(b->flags & B_DIRTY) {
+        panic("idestart: write");
+    }
+
+    virtio_start(b, 1);
+}
+
+// Wait for a read started by idestart, if there is one.
+void idewait(struct buf *b)
+{
+    if(b->flags & B_DISK) {
+        virtio_wait(b);
+    }
+}
+
+// Sync a chain of buffers, linked through qnext: all writes, sorted
+// by block, or all reads. On a virtio disk, each run of adjacent
+// blocks goes as one request, and the requests are all started
+// before we wait for any of them. The memory disk copies the blocks
+// in order.
+void iderwq(struct buf *q)
+{
+    struct buf *b;
+    int n, k;
+
+    if(nvdisk == 0) {
+        for(; q != 0; q = q->qnext) {
+            iderw(q);
+        }
+
+        return;
+    }
+
+    for(n = 0, b = q; b != 0; n++, b = b->qnext) {
+        idecheck(b);
+    }
+
+    for(b = q; b != 0; ) {
+        k = virtio_start(b, n);
+        n -= k;
+
+        while(k-- > 0) {
+            b = b->qnext;
+        }
+    }
+
+    for(b = q; b != 0; b = b->qnext) {
+        virtio_wait(b);
+    }
+}
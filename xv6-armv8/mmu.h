@@ -72,6 +72,13 @@
 
 #define PG_ADDR_MASK	0xFFFFFFFFF000	// bit 47 - bit 12
 
+// For an invalid descriptor (bit 0 clear), the hardware ignores all
+// the other bits. A user page that has been swapped out keeps its AP
+// bits, and stores the swap slot in the address field.
+#define PTE_SWAP	((uint64)1 << 55)
+#define PTE_BUSY	((uint64)1 << 54)	// ... and is still being written
+#define PTE_SLOT(pte)	(((pte) & PG_ADDR_MASK) >> PTE_SHIFT)
+
 // 1st level 
 #define PGD_SHIFT	30
 #define PGD_SZ		(1 << PGD_SHIFT)
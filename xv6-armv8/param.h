@@ -7,12 +7,14 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NBUF         10  // size of disk block cache
-#define NINODE       50  // maximum number of active i-nodes
+#define NBUF         10  // minimum size of disk block cache
+#define NINODE       50  // minimum size of the i-node cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define LOGSIZE      10  // max data sectors in on-disk log
+#define MAXPATH     128  // maximum file path name
+#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
+#define LOGSIZE     (100*1024/BSIZE)  // blocks in the on-disk log made by mkfs (100KB)
 
 #define HZ           10
 
@@ -0,0 +1,261 @@
+// Page cache.
+//
+// Keeps the data of regular files in memory a page (PTE_SZ bytes) at
+// a time, so that reading a file does not go through the buffer
+// cache, which is left to metadata and to blocks on their way to the
+// log. The pages of an inode hang off it in a radix tree indexed by
+// page number: ip->pages is the root of a tree of height ip->pheight
+// whose nodes have RFAN children. A tree of height 0 is just page 0.
+//
+// A page is filled, read and written only with its inode locked.
+// fs.c reads a missing page from the file's blocks, and writei
+// updates a cached page along with the blocks it writes, so the
+// cache never holds anything the file system doesn't. If the disk
+// keeps the blocks of a page in memory, in a row, the page may use
+// that memory in place (see igetpage); writei then has it copied
+// with pcache_modify before changing it.
+//
+// The cache may use 1/PCACHE_SHARE of the memory free at boot; past
+// that, the least recently used page is recycled. pcache.lock
+// protects the trees and the LRU list. A page with ref > 0 is being
+// copied, and is not recycled.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#define PCACHE_SHARE    8   // the cache takes 1/PCACHE_SHARE of free memory
+#define RSHIFT          6
+#define RFAN            (1 << RSHIFT)   // children of a tree node
+
+struct {
+    struct spinlock lock;
+    int npage;      // pages allocated
+    int maxpage;    // pages the cache may have
+
+    // Linked list of all pages, through prev/next.
+    // head.next is the most recently used.
+    struct cpage head;
+} pcache;
+
+void pcacheinit (void)
+{
+    initlock(&pcache.lock, "pcache");
+
+    pcache.npage = 0;
+    pcache.maxpage = kmem_avail() / PCACHE_SHARE / PTE_SZ;
+
+    pcache.head.prev = &pcache.head;
+    pcache.head.next = &pcache.head;
+
+    cprintf("pcache: up to %d pages\n", pcache.maxpage);
+}
+
+// Move p to the head of the LRU list. Caller must hold pcache.lock.
+static void pmru (struct cpage *p)
+{
+    p->next->prev = p->prev;
+    p->prev->next = p->next;
+    p->next = pcache.head.next;
+    p->prev = &pcache.head;
+    pcache.head.next->prev = p;
+    pcache.head.next = p;
+}
+
+// Return the slot for page pn in the tree of ip. If grow is set,
+// add the nodes it takes; otherwise return 0 if there are none.
+// Also return 0 if there is no memory for a node.
+// Caller must hold pcache.lock.
+static void** pslot (struct inode *ip, uint pn, int grow)
+{
+    void **slot, **node;
+    int h;
+
+    // a taller tree, with the old one as its first subtree
+    while ((pn >> (RSHIFT * ip->pheight)) != 0) {
+        if (!grow || (node = kmalloc(get_order(RFAN * sizeof(void*)))) == NULL) {
+            return 0;
+        }
+
+        memset(node, 0, RFAN * sizeof(void*));
+        node[0] = ip->pages;
+        ip->pages = node;
+        ip->pheight++;
+    }
+
+    slot = &ip->pages;
+
+    for (h = ip->pheight; h > 0; h--) {
+        if (*slot == 0) {
+            if (!grow || (node = kmalloc(get_order(RFAN * sizeof(void*)))) == NULL) {
+                return 0;
+            }
+
+            memset(node, 0, RFAN * sizeof(void*));
+            *slot = node;
+        }
+
+        slot = &((void**) *slot)[(pn >> (RSHIFT * (h - 1))) & (RFAN - 1)];
+    }
+
+    return slot;
+}
+
+// Return page pn of ip, held, if it is cached; 0 if it is not.
+struct cpage* pcache_lookup (struct inode *ip, uint pn)
+{
+    struct cpage *p;
+    void **slot;
+
+    acquire(&pcache.lock);
+
+    p = NULL;
+
+    if (((slot = pslot(ip, pn, 0)) != 0) && ((p = *slot) != NULL)) {
+        p->ref++;
+        pmru(p);
+    }
+
+    release(&pcache.lock);
+    return p;
+}
+
+// Return page pn of ip, held. If it was not cached, set *fresh:
+// the caller must fill it in before releasing the inode lock.
+// Return 0 if there is no room for the page.
+struct cpage* pcache_get (struct inode *ip, uint pn, int *fresh)
+{
+    struct cpage *p;
+    void **slot;
+    char *data;
+
+    acquire(&pcache.lock);
+
+    if ((slot = pslot(ip, pn, 1)) == 0) {
+        release(&pcache.lock);
+        return NULL;
+    }
+
+    if ((p = *slot) != NULL) {
+        p->ref++;
+        pmru(p);
+        release(&pcache.lock);
+
+        *fresh = 0;
+        return p;
+    }
+
+    p = NULL;
+
+    // a new page while the cache may grow, the least
+    // recently used one that is not held otherwise
+    if ((pcache.npage < pcache.maxpage) && ((data = alloc_page()) != NULL)) {
+        if ((p = kmalloc(get_order(sizeof(*p)))) == NULL) {
+            kfree(data, PTE_SHIFT);
+
+        } else {
+            p->mem = data;
+            p->next = pcache.head.next;
+            p->prev = &pcache.head;
+            pcache.head.next->prev = p;
+            pcache.head.next = p;
+            pcache.npage++;
+        }
+    }
+
+    if (p == NULL) {
+        for (p = pcache.head.prev; p != &pcache.head; p = p->prev) {
+            if (p->ref == 0) {
+                *pslot(p->ip, p->pn, 0) = NULL;
+                break;
+            }
+        }
+
+        if (p == &pcache.head) {
+            release(&pcache.lock);
+            return NULL;
+        }
+    }
+
+    p->ip = ip;
+    p->pn = pn;
+    p->ref = 1;
+    p->data = p->mem;
+    *slot = p;
+    pmru(p);
+
+    release(&pcache.lock);
+
+    *fresh = 1;
+    return p;
+}
+
+// Release a page returned by pcache_lookup or pcache_get.
+void pcache_put (struct cpage *p)
+{
+    acquire(&pcache.lock);
+
+    if (p->ref < 1) {
+        panic("pcache_put");
+    }
+
+    p->ref--;
+    release(&pcache.lock);
+}
+
+// Give p data of its own, a copy of the disk's, before the caller
+// changes it. Caller must hold the inode lock and p.
+void pcache_modify (struct cpage *p)
+{
+    if (p->data != p->mem) {
+        memmove(p->mem, p->data, PTE_SZ);
+        p->data = p->mem;
+    }
+}
+
+// Free the pages and nodes of a tree of height h.
+// Caller must hold pcache.lock.
+static void pfree (void *node, int h)
+{
+    struct cpage *p;
+    int i;
+
+    if (node == NULL) {
+        return;
+    }
+
+    if (h == 0) {
+        p = node;
+        p->next->prev = p->prev;
+        p->prev->next = p->next;
+
+        kfree(p->mem, PTE_SHIFT);
+        kfree(p, get_order(sizeof(*p)));
+        pcache.npage--;
+        return;
+    }
+
+    for (i = 0; i < RFAN; i++) {
+        pfree(((void**) node)[i], h - 1);
+    }
+
+    kfree(node, get_order(RFAN * sizeof(void*)));
+}
+
+// Forget the pages of ip, whose content is going away or
+// which is leaving the inode cache. None may be held.
+void pcache_drop (struct inode *ip)
+{
+    acquire(&pcache.lock);
+
+    pfree(ip->pages, ip->pheight);
+    ip->pages = NULL;
+    ip->pheight = 0;
+
+    release(&pcache.lock);
+}
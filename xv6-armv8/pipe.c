@@ -4,10 +4,12 @@
 #include "mmu.h"
 #include "proc.h"
 #include "fs.h"
-#include "file.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
 
 #define PIPESIZE 512
+#define PIPECOPY 128  // bytes moved to or from user memory at once
 
 struct pipe {
     struct spinlock lock;
@@ -93,31 +95,41 @@ void pipeclose(struct pipe *p, int writable)
 //PAGEBREAK: 40
 int pipewrite(struct pipe *p, char *addr, int n)
 {
-    int i;
-
-    acquire(&p->lock);
-
-    for(i = 0; i < n; i++){
-        while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
-            if(p->readopen == 0 /*|| proc->killed*/){
-                release(&p->lock);
-                return -1;
+    char buf[PIPECOPY];
+    int i, j, m;
+
+    for(i = 0; i < n; i += m){
+        // copy from user memory without p->lock held: the page
+        // may have to be read back from swap, which sleeps
+        m = (n - i < PIPECOPY) ? n - i : PIPECOPY;
+        memmove(buf, addr + i, m);
+
+        acquire(&p->lock);
+
+        for(j = 0; j < m; j++){
+            while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
+                if(p->readopen == 0 /*|| proc->killed*/){
+                    release(&p->lock);
+                    return -1;
+                }
+
+                wakeup(&p->nread);
+                sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
             }
 
-            wakeup(&p->nread);
-            sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
+            p->data[p->nwrite++ % PIPESIZE] = buf[j];
         }
 
-        p->data[p->nwrite++ % PIPESIZE] = addr[i];
+        wakeup(&p->nread);  //DOC: pipewrite-wakeup1
+        release(&p->lock);
     }
 
-    wakeup(&p->nread);  //DOC: pipewrite-wakeup1
-    release(&p->lock);
     return n;
 }
 
 int piperead(struct pipe *p, char *addr, int n)
 {
+    char buf[PIPECOPY];
     int i;
 
     acquire(&p->lock);
@@ -131,16 +143,19 @@ int piperead(struct pipe *p, char *addr, int n)
         sleep(&p->nread, &p->lock); //DOC: piperead-sleep*/
     }
 
-    for(i = 0; i < n; i++){  //DOC: piperead-copy
+    for(i = 0; (i < n) && (i < PIPECOPY); i++){  //DOC: piperead-copy
         if(p->nread == p->nwrite) {
             break;
         }
 
-        addr[i] = p->data[p->nread++ % PIPESIZE];
+        buf[i] = p->data[p->nread++ % PIPESIZE];
     }
 
     wakeup(&p->nwrite);  //DOC: piperead-wakeup
     release(&p->lock);
 
+    // to user memory, without the lock (see pipewrite)
+    memmove(addr, buf, i);
+
     return i;
 }
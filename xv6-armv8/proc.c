@@ -105,6 +105,29 @@ static struct proc* allocproc(void)
     return p;
 }
 
+// Create a kernel thread that runs fn in the kernel. fn must never
+// return. A kernel thread has no user memory (only an empty page
+// table for switchuvm) and never goes back to user space.
+struct proc* kthread(char *name, void (*fn)(void))
+{
+    struct proc *p;
+
+    if((p = allocproc()) == 0) {
+        panic("kthread: no proc");
+    }
+
+    if((p->pgdir = kpt_alloc()) == NULL) {
+        panic("kthread: out of memory?");
+    }
+
+    p->sz = 0;
+    p->kfn = fn;
+    safestrcpy(p->name, name, sizeof(p->name));
+
+    p->state = RUNNABLE;
+    return p;
+}
+
 void error_init ()
 {
     panic ("failed to craft first process\n");
@@ -267,6 +290,7 @@ void exit(void)
 int wait(void)
 {
     struct proc *p;
+    pgd_t *pgdir;
     int havekids, pid;
 
     acquire(&ptable.lock);
@@ -287,7 +311,8 @@ int wait(void)
                 pid = p->pid;
                 free_page(p->kstack);
                 p->kstack = 0;
-                freevm(p->pgdir);
+                pgdir = p->pgdir;
+                p->pgdir = 0;
                 p->state = UNUSED;
                 p->pid = 0;
                 p->parent = 0;
@@ -295,6 +320,9 @@ int wait(void)
                 p->killed = 0;
                 release(&ptable.lock);
 
+                // may wait for a page on its way to swap
+                freevm(pgdir);
+
                 return pid;
             }
         }
@@ -405,6 +433,14 @@ void forkret(void)
         // be run from main().
         first = 0;
         initlog();
+        fsinit(ROOTDEV);
+        swapinit();
+        bflushinit();
+    }
+
+    if (proc->kfn != 0) {
+        proc->kfn();
+        panic("kthread returned");
     }
 
     // Return to "caller", actually trapret (see allocproc).
@@ -469,6 +505,19 @@ void wakeup(void *chan)
     release(&ptable.lock);
 }
 
+// Wake up process p if it is sleeping on chan. Unlike wakeup,
+// this does not look at any other process.
+void wakeproc(struct proc *p, void *chan)
+{
+    acquire(&ptable.lock);
+
+    if(p->state == SLEEPING && p->chan == chan) {
+        p->state = RUNNABLE;
+    }
+
+    release(&ptable.lock);
+}
+
 // Kill the process with the given pid. Process won't exit until it returns
 // to user space (see trap in trap.c).
 int kill(int pid)
@@ -495,6 +544,13 @@ int kill(int pid)
     return -1;
 }
 
+// Return the process in slot idx of the process table. Used by the
+// page reclaimer to visit the address spaces in turn.
+struct proc* procslot(int idx)
+{
+    return &ptable.proc[idx % NPROC];
+}
+
 //PAGEBREAK: 36
 // Print a process listing to console.  For debugging. Runs when user
 // types ^P on console. No lock to avoid wedging a stuck machine further.
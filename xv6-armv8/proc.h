@@ -80,10 +80,13 @@ struct proc {
     struct trapframe*   tf;         // Trap frame for current syscall
     struct context* context;        // swtch() here to run process
     void*           chan;           // If non-zero, sleeping on chan
+    struct proc*    qnext;          // Next in a sleep lock's wait queue
     int             killed;         // If non-zero, have been killed
     struct file*    ofile[NOFILE];  // Open files
     struct inode*   cwd;            // Current directory
     char            name[16];       // Process name (debugging)
+    void            (*kfn)(void);   // Body of a kernel thread, 0 for user processes
+    int             logresv;        // Log blocks reserved by the running FS operation
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -3,8 +3,14 @@ export PATH=$PATH:/home/lakshman/Acads/695_osdi/qemu_git/qemu-arm/aarch64-softmm
 
 clear
 
+# the file system lives on a virtio disk, and its changes persist in
+# disk.img; remove it to start over from the image of the build
+[ -f disk.img ] || cp build/fs.img disk.img
+
 qemu-system-aarch64 -machine virt -cpu cortex-a57 \
 -machine type=virt -m 128 -nographic \
+-drive file=disk.img,if=none,format=raw,id=hd0 \
+-device virtio-blk-device,drive=hd0 \
 -singlestep -kernel kernel.elf 
 # skip: -singlestep
 # try skip -cpu, as str r0, [fp,#-8] not write onto mem
@@ -0,0 +1,91 @@
+// Sleeping locks
+//
+// A sleep lock may be held across operations that block, such as
+// disk I/O. Waiters sleep on a queue of their own instead of spinning
+// or going through a shared channel. The queue is FIFO and the lock is
+// handed directly to the first waiter on release, so only that process
+// is woken and a waiter cannot be overtaken by later arrivals.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "arm.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+
+void initsleeplock (struct sleeplock *lk, char *name)
+{
+    initlock(&lk->lk, "sleep lock");
+    lk->name = name;
+    lk->locked = 0;
+    lk->head = 0;
+    lk->tail = 0;
+    lk->pid = 0;
+}
+
+void acquiresleep (struct sleeplock *lk)
+{
+    acquire(&lk->lk);
+
+    if (!lk->locked) {
+        lk->locked = 1;
+        lk->pid = proc->pid;
+        release(&lk->lk);
+        return;
+    }
+
+    // wait in line, releasesleep passes the lock on to us
+    proc->qnext = 0;
+
+    if (lk->tail != 0) {
+        lk->tail->qnext = proc;
+    } else {
+        lk->head = proc;
+    }
+
+    lk->tail = proc;
+
+    while (lk->pid != proc->pid) {
+        sleep(lk, &lk->lk);
+    }
+
+    release(&lk->lk);
+}
+
+void releasesleep (struct sleeplock *lk)
+{
+    struct proc *p;
+
+    acquire(&lk->lk);
+
+    if ((p = lk->head) != 0) {
+        // hand the lock to the first waiter, it stays locked
+        if ((lk->head = p->qnext) == 0) {
+            lk->tail = 0;
+        }
+
+        p->qnext = 0;
+        lk->pid = p->pid;
+        wakeproc(p, lk);
+
+    } else {
+        lk->locked = 0;
+        lk->pid = 0;
+    }
+
+    release(&lk->lk);
+}
+
+int holdingsleep (struct sleeplock *lk)
+{
+    int r;
+
+    acquire(&lk->lk);
+    r = lk->locked && (lk->pid == proc->pid);
+    release(&lk->lk);
+
+    return r;
+}
@@ -0,0 +1,11 @@
+// Long-term locks for processes
+struct sleeplock {
+    uint            locked;     // Is the lock held?
+    struct spinlock lk;         // spinlock protecting this sleep lock
+    struct proc     *head;      // processes waiting for the lock,
+    struct proc     *tail;      // in arrival order, through qnext
+
+    // For debugging:
+    char            *name;      // Name of lock.
+    int             pid;        // Process holding lock
+};
@@ -237,7 +237,7 @@ void start (void)
     // V, P, len, is_mem
     set_bootpgtbl((uint64)KERNBASE+(uint64)DEVBASE1, (uint64)DEVBASE1, DEV_MEM_SZ, 1); // V, P, SZ, ISDEV
     set_bootpgtbl((uint64)KERNBASE+(uint64)DEVBASE2, (uint64)DEVBASE2, DEV_MEM_SZ, 1); // V, P, SZ, ISDEV
-    set_bootpgtbl((uint64)KERNBASE+(uint64)DEVBASE3, (uint64)DEVBASE2, DEV_MEM_SZ, 1); // V, P, SZ, ISDEV
+    set_bootpgtbl((uint64)KERNBASE+(uint64)DEVBASE3, (uint64)DEVBASE3, DEV_MEM_SZ, 1); // V, P, SZ, ISDEV
 
     load_pgtlb (kernel_pgtbl, user_pgtbl);
 
@@ -9,3 +9,10 @@ struct stat {
     short   nlink; // Number of links to file
     uint    size;  // Size of file in bytes
 };
+
+// A directory entry with the attributes of its inode,
+// as returned by getdents().
+struct dirstat {
+    char    name[14];  // DIRSIZ, not NUL-terminated if that long
+    struct stat st;
+};
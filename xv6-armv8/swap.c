@@ -0,0 +1,145 @@
+// Swap space for user pages.
+//
+// The swap area is a run of blocks on the root device, placed right
+// after the file system by mkfs (sb.nswap). It is divided into slots of
+// one page each. The allocation status of the slots is kept in a bitmap
+// in memory; nothing about swap survives a reboot.
+//
+// The reclaimer (see reclaim_page in vm.c) writes a victim page to a
+// free slot and records the slot in the PTE. The page fault handler
+// reads it back when the page is touched again.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "buf.h"
+#include "fs.h"
+
+#define BLK_PER_PG  (PTE_SZ / BSIZE)
+
+struct {
+    struct spinlock lock;
+    uint    start;      // first block of the swap area
+    uint    nslot;      // number of page slots
+    uint    nfree;      // number of free slots
+    uint    next;       // where to start looking for a free slot
+    uint8   *map;       // slot bitmap (1 = in use)
+    struct buf buf;     // buffer for swap I/O, locked while in use
+} swap;
+
+void swapinit (void)
+{
+    struct superblock sb;
+    uint len;
+
+    initlock(&swap.lock, "swap");
+    initsleeplock(&swap.buf.lock, "swap buffer");
+
+    if ((swap.buf.data = kmalloc(get_order(BSIZE))) == NULL) {
+        panic("swapinit: no memory for swap buffer");
+    }
+
+    readsb(ROOTDEV, &sb);
+    swap.start = sb.size;
+    swap.nslot = sb.nswap / BLK_PER_PG;
+    swap.nfree = swap.nslot;
+    swap.next = 0;
+
+    if (swap.nslot == 0) {
+        return;
+    }
+
+    len = (swap.nslot + 7) / 8;
+
+    if ((swap.map = kmalloc(get_order(len))) == NULL) {
+        panic("swapinit: no memory for swap map");
+    }
+
+    memset(swap.map, 0, len);
+    cprintf("swap: %d pages at block %d\n", swap.nslot, swap.start);
+}
+
+// Allocate a swap slot. Return -1 if the swap area is full.
+int swap_alloc (void)
+{
+    uint i, slot;
+
+    acquire(&swap.lock);
+
+    for (i = 0; i < swap.nslot && swap.nfree > 0; i++) {
+        slot = (swap.next + i) % swap.nslot;
+
+        if (!(swap.map[slot / 8] & (1 << (slot % 8)))) {
+            swap.map[slot / 8] |= 1 << (slot % 8);
+            swap.nfree--;
+            swap.next = slot + 1;
+            release(&swap.lock);
+            return slot;
+        }
+    }
+
+    release(&swap.lock);
+    return -1;
+}
+
+// Release a swap slot.
+void swap_free (uint slot)
+{
+    acquire(&swap.lock);
+
+    if ((slot >= swap.nslot) || !(swap.map[slot / 8] & (1 << (slot % 8)))) {
+        panic("swap_free");
+    }
+
+    swap.map[slot / 8] &= ~(1 << (slot % 8));
+    swap.nfree++;
+
+    release(&swap.lock);
+}
+
+// Move a page between memory and its swap slot, one block at a time.
+static void swap_rw (uint slot, char *page, int write)
+{
+    struct buf *b;
+    int i;
+
+    if (slot >= swap.nslot) {
+        panic("swap_rw: bad slot");
+    }
+
+    b = &swap.buf;
+    acquiresleep(&b->lock);
+
+    for (i = 0; i < BLK_PER_PG; i++) {
+        b->dev = ROOTDEV;
+        b->sector = swap.start + slot * BLK_PER_PG + i;
+
+        if (write) {
+            memmove(b->data, page + i * BSIZE, BSIZE);
+            b->flags = B_DIRTY;
+            iderw(b);
+        } else {
+            b->flags = 0;
+            iderw(b);
+            memmove(page + i * BSIZE, b->data, BSIZE);
+        }
+    }
+
+    releasesleep(&b->lock);
+}
+
+// Write a page to its swap slot.
+void swap_write (uint slot, char *page)
+{
+    swap_rw(slot, page, 1);
+}
+
+// Read a page back from its swap slot.
+void swap_read (uint slot, char *page)
+{
+    swap_rw(slot, page, 0);
+}
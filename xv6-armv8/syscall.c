@@ -14,35 +14,15 @@
 // Fetch the int at addr from the current process.
 int fetchint(uint64 addr, long *ip)
 {
-    if(addr >= proc->sz || addr+8 > proc->sz) {
-        return -1;
-    }
-
-    *ip = *(long*)(addr);
-    return 0;
+    return copyin(ip, addr, sizeof(*ip));
 }
 
-// Fetch the nul-terminated string at addr from the current process.
-// Doesn't actually copy the string - just sets *pp to point at it.
-// Returns length of string, not including nul.
-int fetchstr(uint64 addr, char **pp)
+// Fetch the nul-terminated string at addr from the current process
+// into buf, which holds max bytes.
+// Returns length of string, not including nul, or -1 for error.
+int fetchstr(uint64 addr, char *buf, int max)
 {
-    char *s, *ep;
-
-    if(addr >= proc->sz) {
-        return -1;
-    }
-
-    *pp = (char*)addr;
-    ep = (char*)proc->sz;
-
-    for(s = *pp; s < ep; s++) {
-        if(*s == 0) {
-            return s - *pp;
-        }
-    }
-
-    return -1;
+    return copyinstr(buf, addr, max);
 }
 
 // Fetch the nth (starting from 0) 32-bit system call argument.
@@ -78,11 +58,10 @@ int argptr(int n, char **pp, int size)
     return 0;
 }
 
-// Fetch the nth word-sized system call argument as a string pointer.
-// Check that the pointer is valid and the string is nul-terminated.
-// (There is no shared writable memory, so the string can't change
-// between this check and being used by the kernel.)
-int argstr(int n, char **pp)
+// Fetch the nth word-sized system call argument as a nul-terminated
+// string. Copies into buf, at most max bytes.
+// Returns string length if OK (including 0), -1 if error.
+int argstr(int n, char *buf, int max)
 {
     long addr;
 
@@ -90,7 +69,7 @@ int argstr(int n, char **pp)
         return -1;
     }
 
-    return fetchstr(addr, pp);
+    return fetchstr(addr, buf, max);
 }
 
 extern int sys_chdir(void);
@@ -114,6 +93,9 @@ extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
+extern int sys_sync(void);
+extern int sys_fsync(void);
+extern int sys_getdents(void);
 
 static int (*syscalls[])(void) = {
         [SYS_fork]    sys_fork,
@@ -137,6 +119,9 @@ static int (*syscalls[])(void) = {
         [SYS_link]    sys_link,
         [SYS_mkdir]   sys_mkdir,
         [SYS_close]   sys_close,
+        [SYS_sync]    sys_sync,
+        [SYS_fsync]   sys_fsync,
+        [SYS_getdents] sys_getdents,
 };
 
 void syscall(void)
@@ -20,3 +20,6 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_sync   22
+#define SYS_fsync  23
+#define SYS_getdents 24
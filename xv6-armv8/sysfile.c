@@ -11,6 +11,8 @@
 #include "mmu.h"
 #include "proc.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
 
@@ -87,6 +89,22 @@ int sys_read(void)
     return fileread(f, p, n);
 }
 
+// Read many directory entries, with the attributes of their
+// inodes, in one call: what read() and stat() on each entry do.
+int sys_getdents(void)
+{
+    struct file *f;
+    struct dirstat *ds;
+    long n;
+
+    if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || n < 0 || n > proc->sz / sizeof(*ds)
+            || argptr(1, (void*)&ds, n * sizeof(*ds)) < 0) {
+        return -1;
+    }
+
+    return filegetdents(f, ds, n);
+}
+
 int sys_write(void)
 {
     struct file *f;
@@ -127,13 +145,35 @@ int sys_fstat(void)
     return filestat(f, st);
 }
 
+// Write all committed changes to their home locations on disk.
+int sys_sync(void)
+{
+    log_sync();
+    return 0;
+}
+
+// Make the committed changes to an open file durable. Writes to
+// the file system are already durable once their transaction has
+// committed; fsync also writes them back from the log, like sync.
+int sys_fsync(void)
+{
+    struct file *f;
+
+    if(argfd(0, 0, &f) < 0) {
+        return -1;
+    }
+
+    log_sync();
+    return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 int sys_link(void)
 {
-    char name[DIRSIZ], *new, *old;
+    char name[DIRSIZ], new[MAXPATH], old[MAXPATH];
     struct inode *dp, *ip;
 
-    if(argstr(0, &old) < 0 || argstr(1, &new) < 0) {
+    if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0) {
         return -1;
     }
 
@@ -141,7 +181,7 @@ int sys_link(void)
         return -1;
     }
 
-    begin_trans();
+    begin_trans_n(DX_OPBLOCKS);
 
     ilock(ip);
 
@@ -183,17 +223,18 @@ int sys_link(void)
 }
 
 // Is the directory dp empty except for "." and ".." ?
+// In an indexed directory, they can be anywhere.
 static int isdirempty(struct inode *dp)
 {
     int off;
     struct dirent de;
 
-    for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+    for(off=0; off<dp->size; off+=sizeof(de)){
         if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de)) {
             panic("isdirempty: readi");
         }
 
-        if(de.inum != 0) {
+        if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0) {
             return 0;
         }
     }
@@ -205,10 +246,10 @@ int sys_unlink(void)
 {
     struct inode *ip, *dp;
     struct dirent de;
-    char name[DIRSIZ], *path;
+    char name[DIRSIZ], path[MAXPATH];
     uint off;
 
-    if(argstr(0, &path) < 0) {
+    if(argstr(0, path, MAXPATH) < 0) {
         return -1;
     }
 
@@ -246,6 +287,8 @@ int sys_unlink(void)
         panic("unlink: writei");
     }
 
+    dcache_enter(dp->dev, dp->inum, name, 0, 0);  // it's gone now
+
     if(ip->type == T_DIR){
         dp->nlink--;
         iupdate(dp);
@@ -292,7 +335,7 @@ static struct inode* create(char *path, short type, short major, short minor)
         return 0;
     }
 
-    if((ip = ialloc(dp->dev, type)) == 0) {
+    if((ip = ialloc(dp->dev, type, dp->inum)) == 0) {
         panic("create: ialloc");
     }
 
@@ -312,8 +355,17 @@ static struct inode* create(char *path, short type, short major, short minor)
         }
     }
 
-    if(dirlink(dp, name, ip->inum) < 0) {
-        panic("create: dirlink");
+    if(dirlink(dp, name, ip->inum) < 0) {  // dp is full
+        if(type == T_DIR){
+            dp->nlink--;
+            iupdate(dp);
+        }
+
+        ip->nlink = 0;
+        iupdate(ip);
+        iunlockput(ip);
+        iunlockput(dp);
+        return 0;
     }
 
     iunlockput(dp);
@@ -323,17 +375,17 @@ static struct inode* create(char *path, short type, short major, short minor)
 
 int sys_open(void)
 {
-    char *path;
+    char path[MAXPATH];
     long fd, omode;
     struct file *f;
     struct inode *ip;
 
-    if(argstr(0, &path) < 0 || argint(1, &omode) < 0) {
+    if(argstr(0, path, MAXPATH) < 0 || argint(1, &omode) < 0) {
         return -1;
     }
 
     if(omode & O_CREATE){
-        begin_trans();
+        begin_trans_n(DX_OPBLOCKS);
         ip = create(path, T_FILE, 0, 0);
         commit_trans();
 
@@ -376,12 +428,12 @@ int sys_open(void)
 
 int sys_mkdir(void)
 {
-    char *path;
+    char path[MAXPATH];
     struct inode *ip;
 
-    begin_trans();
+    begin_trans_n(DX_OPBLOCKS);
 
-    if(argstr(0, &path) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
+    if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
         commit_trans();
         return -1;
     }
@@ -395,13 +447,13 @@ int sys_mkdir(void)
 int sys_mknod(void)
 {
     struct inode *ip;
-    char *path;
+    char path[MAXPATH];
     int len;
     long major, minor;
 
-    begin_trans();
+    begin_trans_n(DX_OPBLOCKS);
 
-    if((len=argstr(0, &path)) < 0 ||
+    if((len=argstr(0, path, MAXPATH)) < 0 ||
             argint(1, &major) < 0 || argint(2, &minor) < 0 ||
             (ip = create(path, T_DEV, major, minor)) == 0){
 
@@ -417,10 +469,10 @@ int sys_mknod(void)
 
 int sys_chdir(void)
 {
-    char *path;
+    char path[MAXPATH];
     struct inode *ip;
 
-    if(argstr(0, &path) < 0 || (ip = namei(path)) == 0) {
+    if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0) {
         return -1;
     }
 
@@ -441,23 +493,24 @@ int sys_chdir(void)
 
 int sys_exec(void)
 {
-    char *path, *argv[MAXARG];
-    int i;
+    char path[MAXPATH], *argv[MAXARG];
+    int i, ret;
     uint64 uargv, uarg;
 
-    if(argstr(0, &path) < 0 || argint(1, (long*)&uargv) < 0){
+    if(argstr(0, path, MAXPATH) < 0 || argint(1, (long*)&uargv) < 0){
         return -1;
     }
 
     memset(argv, 0, sizeof(argv));
+    ret = -1;
 
     for(i=0;; i++){
         if(i >= NELEM(argv)) {
-            return -1;
+            goto bad;
         }
 
         if(fetchint(uargv+8*i, (long*)&uarg) < 0) {
-            return -1;
+            goto bad;
         }
 
         if(uarg == 0){
@@ -465,12 +518,24 @@ int sys_exec(void)
             break;
         }
 
-        if(fetchstr(uarg, &argv[i]) < 0) {
-            return -1;
+        // copy each argument into a page of its own
+        if((argv[i] = kmalloc(PTE_SHIFT)) == 0) {
+            goto bad;
+        }
+
+        if(fetchstr(uarg, argv[i], PTE_SZ) < 0) {
+            goto bad;
         }
     }
 
-    return exec(path, argv);
+    ret = exec(path, argv);
+
+    bad:
+    for(i = 0; i < NELEM(argv) && argv[i] != 0; i++) {
+        kfree(argv[i], PTE_SHIFT);
+    }
+
+    return ret;
 }
 
 int sys_pipe(void)
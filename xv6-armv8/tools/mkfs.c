@@ -13,14 +13,15 @@
 
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 
-int nblocks = 985;
+int nblocks;  // what the rest leaves
 int nlog = LOGSIZE;
 int ninodes = 200;
-int size = 1024;
+int size = 512*1024/BSIZE;  // 512KB of file system
+int nswap = 512*1024/BSIZE; // and as much swap
 
 int fsfd;
 struct superblock sb;
-char zeroes[512];
+char zeroes[BSIZE];
 uint freeblock;
 uint usedblocks;
 uint bitblocks;
@@ -33,6 +34,12 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint bmapent(uint *p);
+void rootlink(char *name, uint inum);
+void wdir(uint inum, struct dirent *de, int n);
+
+struct dirent rootdir[DPB << DX_MAXDEPTH];
+int nroot;
 
 // convert to intel byte order
 ushort
@@ -62,8 +69,7 @@ main(int argc, char *argv[])
 {
   int i, cc, fd;
   uint rootino, inum, off;
-  struct dirent de;
-  char buf[512];
+  char buf[BSIZE];
   struct dinode din;
 
 
@@ -74,8 +80,8 @@ main(int argc, char *argv[])
     exit(1);
   }
 
-  assert((512 % sizeof(struct dinode)) == 0);
-  assert((512 % sizeof(struct dirent)) == 0);
+  assert((BSIZE % sizeof(struct dinode)) == 0);
+  assert((BSIZE % sizeof(struct dirent)) == 0);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -83,21 +89,25 @@ main(int argc, char *argv[])
     exit(1);
   }
 
+  bitblocks = size/BPB + 1;
+  usedblocks = ninodes / IPB + 3 + bitblocks;
+  freeblock = usedblocks;
+  nblocks = size - usedblocks - nlog;
+
   sb.size = xint(size);
   sb.nblocks = xint(nblocks); // so whole disk is size sectors
   sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
+  sb.nswap = xint(nswap);
+  sb.bsize = xint(BSIZE);
 
-  bitblocks = size/(512*8) + 1;
-  usedblocks = ninodes / IPB + 3 + bitblocks;
-  freeblock = usedblocks;
-
-  printf("used %d (bit %d ninode %zu) free %u log %u total %d\n", usedblocks,
-         bitblocks, ninodes/IPB + 1, freeblock, nlog, nblocks+usedblocks+nlog);
+  printf("used %d (bit %d ninode %zu) free %u log %u total %d swap %d\n", usedblocks,
+         bitblocks, ninodes/IPB + 1, freeblock, nlog, nblocks+usedblocks+nlog, nswap);
 
   assert(nblocks + usedblocks + nlog == size);
 
-  for(i = 0; i < nblocks + usedblocks + nlog; i++)
+  // the swap area is placed right after the file system
+  for(i = 0; i < size + nswap; i++)
     wsect(i, zeroes);
 
   memset(buf, 0, sizeof(buf));
@@ -107,15 +117,8 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootlink(".", rootino);
+  rootlink("..", rootino);
 
   for(i = 2; i < argc; i++){
     assert(index(argv[i], '/') == 0);
@@ -133,11 +136,7 @@ main(int argc, char *argv[])
       ++argv[i];
 
     inum = ialloc(T_FILE);
-
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    rootlink(argv[i], inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -145,10 +144,12 @@ main(int argc, char *argv[])
     close(fd);
   }
 
+  wdir(rootino, rootdir, nroot);
+
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
+  off = ((off + BSIZE - 1) / BSIZE) * BSIZE;
   din.size = xint(off);
   winode(rootino, &din);
 
@@ -160,11 +161,11 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * 512L, 0) != sec * 512L){
+  if(lseek(fsfd, sec * (long)BSIZE, 0) != sec * (long)BSIZE){
     perror("lseek");
     exit(1);
   }
-  if(write(fsfd, buf, 512) != 512){
+  if(write(fsfd, buf, BSIZE) != BSIZE){
     perror("write");
     exit(1);
   }
@@ -179,7 +180,7 @@ i2b(uint inum)
 void
 winode(uint inum, struct dinode *ip)
 {
-  char buf[512];
+  char buf[BSIZE];
   uint bn;
   struct dinode *dip;
 
@@ -193,7 +194,7 @@ winode(uint inum, struct dinode *ip)
 void
 rinode(uint inum, struct dinode *ip)
 {
-  char buf[512];
+  char buf[BSIZE];
   uint bn;
   struct dinode *dip;
 
@@ -206,11 +207,11 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * 512L, 0) != sec * 512L){
+  if(lseek(fsfd, sec * (long)BSIZE, 0) != sec * (long)BSIZE){
     perror("lseek");
     exit(1);
   }
-  if(read(fsfd, buf, 512) != 512){
+  if(read(fsfd, buf, BSIZE) != BSIZE){
     perror("read");
     exit(1);
   }
@@ -230,64 +231,133 @@ ialloc(ushort type)
   return inum;
 }
 
+void
+rootlink(char *name, uint inum)
+{
+  assert(nroot < sizeof(rootdir) / sizeof(rootdir[0]));
+  bzero(&rootdir[nroot], sizeof(rootdir[nroot]));
+  rootdir[nroot].inum = xshort(inum);
+  strncpy(rootdir[nroot].name, name, DIRSIZ);
+  nroot++;
+}
+
+// Write the entries of directory inum: as an array if they fit in
+// a block, indexed otherwise (see fs.h).
+void
+wdir(uint inum, struct dirent *de, int n)
+{
+  struct dirent leaf[DPB];
+  ushort index[BSIZE / sizeof(ushort)];
+  int depth, i, j, k;
+
+  if(n <= DPB){
+    iappend(inum, de, n * sizeof(*de));
+    return;
+  }
+
+  // the smallest index whose leaves all fit in a block
+  for(depth = 0; ; depth++){
+    assert(depth <= DX_MAXDEPTH);
+    for(i = 0; i < (1 << depth); i++){
+      for(j = 0, k = 0; j < n; j++)
+        if((dirhash(de[j].name) & ((1 << depth) - 1)) == i)
+          k++;
+      if(k > DPB)
+        break;
+    }
+    if(i == (1 << depth))
+      break;
+  }
+
+  bzero(index, sizeof(index));
+  index[1] = xshort(DX_MAGIC);
+  index[2] = xshort(depth);
+  for(i = 0; i < (1 << depth); i++)
+    index[DX_SLOT(i)] = xshort(1 + i);
+  iappend(inum, index, BSIZE);
+
+  for(i = 0; i < (1 << depth); i++){
+    bzero(leaf, sizeof(leaf));
+    for(j = 0, k = 0; j < n; j++)
+      if((dirhash(de[j].name) & ((1 << depth) - 1)) == i)
+        leaf[k++] = de[j];
+    iappend(inum, leaf, BSIZE);
+  }
+}
+
 void
 balloc(int used)
 {
-  uchar buf[512];
+  uchar buf[BSIZE];
   int i;
 
-  printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < 512*8);
-  bzero(buf, 512);
+  printf("balloc: first %d blocks and the log have been allocated\n", used);
+  assert(size <= BPB);
+  bzero(buf, BSIZE);
   for(i = 0; i < used; i++){
     buf[i/8] = buf[i/8] | (0x1 << (i%8));
   }
+  // the log, at the end of the file system
+  for(i = size - nlog; i < size; i++){
+    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  }
   printf("balloc: write bitmap block at sector %zu\n", ninodes/IPB + 3);
   wsect(ninodes / IPB + 3, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Allocate a block for the address *p (in disk byte order)
+// if it has none; return the block.
+uint
+bmapent(uint *p)
+{
+  if(xint(*p) == 0){
+    *p = xint(freeblock++);
+    usedblocks++;
+  }
+  return xint(*p);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
   uint fbn, off, n1;
   struct dinode din;
-  char buf[512];
+  char buf[BSIZE];
   uint indirect[NINDIRECT];
-  uint x;
+  uint x, y, bn, span;
+  int level;
 
   rinode(inum, &din);
 
   off = xint(din.size);
   while(n > 0){
-    fbn = off / 512;
+    fbn = off / BSIZE;
     assert(fbn < MAXFILE);
     if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-        usedblocks++;
-      }
-      x = xint(din.addrs[fbn]);
+      x = bmapent(&din.addrs[fbn]);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        // printf("allocate indirect block\n");
-        din.addrs[NDIRECT] = xint(freeblock++);
-        usedblocks++;
+      // find the tree of indirect blocks that maps fbn
+      bn = fbn - NDIRECT;
+      span = NINDIRECT;
+      for(level = 0; bn >= span; level++){
+        bn -= span;
+        span *= NINDIRECT;
       }
-      // printf("read indirect block\n");
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        usedblocks++;
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      x = bmapent(&din.addrs[NDIRECT + level]);
+      for(span /= NINDIRECT; span > 0; span /= NINDIRECT){
+        rsect(x, (char*)indirect);
+        y = bmapent(&indirect[bn / span]);
+        wsect(x, (char*)indirect);
+        x = y;
+        bn %= span;
       }
-      x = xint(indirect[fbn-NDIRECT]);
     }
-    n1 = min(n, (fbn + 1) * 512 - off);
+    n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
-    bcopy(p, buf + off - (fbn * 512), n1);
+    bcopy(p, buf + off - (fbn * BSIZE), n1);
     wsect(x, buf);
     n -= n1;
     off += n1;
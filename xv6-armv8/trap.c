@@ -25,30 +25,88 @@ void irq_handler (struct trapframe *r, uint32 el, uint32 esr)
     pic_dispatch (r);
 }
 
+// a fault that could not be resolved: kill the user process,
+// or give up if the kernel itself faulted
+static void bad_fault (uint32 el)
+{
+    if ((el == 0) && (proc != NULL)) {
+        proc->killed = 1;
+        exit();
+    }
+
+    panic("kernel abort");
+}
+
+// The exception table lists the kernel instructions that access user
+// memory (see usercopy.S), each with the address to resume at if the
+// access faults. It is collected by kernel.ld.
+struct extable {
+    uint64  insn;
+    uint64  fixup;
+};
+
+extern struct extable __start_ex_table[], __stop_ex_table[];
+
+// find the fixup for a faulting kernel instruction, or 0 if there is none
+static uint64 extable_fixup (uint64 pc)
+{
+    struct extable *e;
+
+    for (e = __start_ex_table; e < __stop_ex_table; e++) {
+        if (e->insn == pc) {
+            return e->fixup;
+        }
+    }
+
+    return 0;
+}
+
 // trap routine
 void dabort_handler (struct trapframe *r, uint32 el, uint32 esr)
 {
-    uint64 fa;
+    uint64 fa, fixup;
     extern void show_callstk (char *s);
-    cli();
 
     // read the fault address register
     asm("MRS %[r], FAR_EL1": [r]"=r" (fa)::);
-    
+
+    // the page may have been aged or swapped out by the reclaimer
+    if ((proc != NULL) && (pgfault(proc->pgdir, fa) == 0)) {
+        return;
+    }
+
+    // a bad user address passed to the kernel, fail the copy
+    if ((el == 1) && ((fixup = extable_fixup(r->pc)) != 0)) {
+        r->pc = fixup;
+        return;
+    }
+
+    cli();
     cprintf ("data abort: instruction 0x%x, fault addr 0x%x\n",
              r->pc, fa);
   
     dump_trapframe (r);
     //show_callstk("Stack dump for data exception.");
+    bad_fault(el);
 }
 
 // trap routine
 void iabort_handler (struct trapframe *r, uint32 el, uint32 esr)
 {
+    uint64 fa;
+
+    asm("MRS %[r], FAR_EL1": [r]"=r" (fa)::);
+
+    // user text can be swapped out like any other page
+    if ((el == 0) && (proc != NULL) && (pgfault(proc->pgdir, fa) == 0)) {
+        return;
+    }
+
     cli();
     cprintf ("prefetch abort at: 0x%x\n", r->pc);
 
     dump_trapframe (r);
+    bad_fault(el);
 }
 
 // trap routine
@@ -25,9 +25,9 @@ fmtname(char *path)
 void
 ls(char *path)
 {
-    char buf[512], *p;
-    int fd;
-    struct dirent de;
+    char name[DIRSIZ+1];
+    int fd, i, n;
+    struct dirstat ds[32];
     struct stat st;
     
     if((fd = open(path, 0)) < 0){
@@ -47,23 +47,14 @@ ls(char *path)
             break;
             
         case T_DIR:
-            if(strlen(path) + 1 + DIRSIZ + 1 > sizeof buf){
-                printf(1, "ls: path too long\n");
-                break;
-            }
-            strcpy(buf, path);
-            p = buf+strlen(buf);
-            *p++ = '/';
-            while(read(fd, &de, sizeof(de)) == sizeof(de)){
-                if(de.inum == 0)
-                    continue;
-                memmove(p, de.name, DIRSIZ);
-                p[DIRSIZ] = 0;
-                if(stat(buf, &st) < 0){
-                    printf(1, "ls: cannot stat %s\n", buf);
-                    continue;
+            // getdents returns the entries together with what
+            // stat() would say about them.
+            while((n = getdents(fd, ds, sizeof(ds)/sizeof(ds[0]))) > 0){
+                for(i = 0; i < n; i++){
+                    memmove(name, ds[i].name, DIRSIZ);
+                    name[DIRSIZ] = 0;
+                    printf(1, "%s %d %d %d\n", fmtname(name), ds[i].st.type, ds[i].st.ino, ds[i].st.size);
                 }
-                printf(1, "%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
             }
             break;
     }
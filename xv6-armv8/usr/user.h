@@ -1,4 +1,5 @@
 struct stat;
+struct dirstat;
 
 // system calls
 int fork(void);
@@ -22,6 +23,9 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int sync(void);
+int fsync(int);
+int getdents(int, struct dirstat*, int);
 
 // ulib.c
 int stat(char*, struct stat*);
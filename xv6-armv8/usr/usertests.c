@@ -12,6 +12,9 @@ char name[3];
 char *echoargv[] = { "echo", "ALL", "TESTS", "PASSED", 0 };
 int stdout = 1;
 
+// blocks in the file of writetest1: past the single indirect block
+#define BIGBLOCKS (NDIRECT + NINDIRECT + 10)
+
 // simple file system tests
 
 void
@@ -96,9 +99,9 @@ writetest1(void)
         exit();
     }
     
-    for(i = 0; i < MAXFILE; i++){
+    for(i = 0; i < BIGBLOCKS; i++){
         ((int*)buf)[0] = i;
-        if(write(fd, buf, 512) != 512){
+        if(write(fd, buf, BSIZE) != BSIZE){
             printf(stdout, "error: write big file failed\n", i);
             exit();
         }
@@ -114,14 +117,14 @@ writetest1(void)
     
     n = 0;
     for(;;){
-        i = read(fd, buf, 512);
+        i = read(fd, buf, BSIZE);
         if(i == 0){
-            if(n == MAXFILE - 1){
+            if(n == BIGBLOCKS - 1){
                 printf(stdout, "read only %d blocks from big", n);
                 exit();
             }
             break;
-        } else if(i != 512){
+        } else if(i != BSIZE){
             printf(stdout, "read failed %d\n", i);
             exit();
         }
@@ -1240,6 +1243,118 @@ dirfile(void)
     printf(1, "dir vs file OK\n");
 }
 
+// getdents returns every entry of a directory with what stat()
+// says about it, and a later call goes on where the last stopped.
+void
+getdentstest(void)
+{
+    struct dirstat ds[16], all[16];
+    struct stat st;
+    char path[32];
+    int fd, i, j, k, n, nall, seen;
+    
+    printf(1, "getdents test\n");
+    
+    if(mkdir("gd") < 0){
+        printf(1, "mkdir gd failed\n");
+        exit();
+    }
+    strcpy(path, "gd/f0");
+    for(i = 0; i < 5; i++){
+        path[4] = '0' + i;
+        fd = open(path, O_CREATE|O_RDWR);
+        if(fd < 0){
+            printf(1, "create %s failed\n", path);
+            exit();
+        }
+        write(fd, buf, i + 1);
+        close(fd);
+    }
+    if(mkdir("gd/sub") < 0){
+        printf(1, "mkdir gd/sub failed\n");
+        exit();
+    }
+    
+    // ".", "..", f0 to f4 and sub
+    fd = open("gd", 0);
+    nall = getdents(fd, all, 16);
+    close(fd);
+    if(nall != 8){
+        printf(1, "getdents gd returned %d entries\n", nall);
+        exit();
+    }
+    seen = 0;
+    for(i = 0; i < nall; i++){
+        strcpy(path, "gd/");
+        memmove(path + 3, all[i].name, DIRSIZ);
+        path[3 + DIRSIZ] = 0;
+        if(stat(path, &st) < 0){
+            printf(1, "stat %s failed\n", path);
+            exit();
+        }
+        if(st.type != all[i].st.type || st.dev != all[i].st.dev ||
+           st.ino != all[i].st.ino || st.nlink != all[i].st.nlink ||
+           st.size != all[i].st.size){
+            printf(1, "getdents and stat differ on %s\n", path);
+            exit();
+        }
+        if(strcmp(path, "gd/.") == 0)
+            seen |= 1;
+        else if(strcmp(path, "gd/..") == 0)
+            seen |= 2;
+        else if(strcmp(path, "gd/sub") == 0)
+            seen |= 4;
+        else if(path[3] == 'f' && path[4] >= '0' && path[4] < '5' && path[5] == 0)
+            seen |= 8 << (path[4] - '0');
+    }
+    if(seen != 0xff){
+        printf(1, "getdents gd missed entries: %x\n", seen);
+        exit();
+    }
+    
+    // a few entries at a time, the same ones in the same order
+    fd = open("gd", 0);
+    i = 0;
+    while((n = getdents(fd, ds, 3)) > 0){
+        if(n > 3 || i + n > nall){
+            printf(1, "getdents gd returned %d entries after %d\n", n, i);
+            exit();
+        }
+        for(j = 0; j < n; j++, i++){
+            for(k = 0; k < DIRSIZ && ds[j].name[k] == all[i].name[k]; k++)
+                ;
+            if(k < DIRSIZ || ds[j].st.ino != all[i].st.ino){
+                printf(1, "getdents gd entry %d differs\n", i);
+                exit();
+            }
+        }
+    }
+    close(fd);
+    if(n < 0 || i != nall){
+        printf(1, "getdents gd in pieces returned %d entries\n", i);
+        exit();
+    }
+    
+    fd = open("gd/f0", 0);
+    if(getdents(fd, ds, 16) >= 0){
+        printf(1, "getdents on a file succeeded!\n");
+        exit();
+    }
+    close(fd);
+    
+    strcpy(path, "gd/f0");
+    for(i = 0; i < 5; i++){
+        path[4] = '0' + i;
+        unlink(path);
+    }
+    if(unlink("gd/sub") < 0 || unlink("gd") < 0){
+        printf(1, "unlink gd failed\n");
+        exit();
+    }
+    
+    printf(1, "getdents ok\n");
+}
+
 // test that iput() is called at the end of _namei()
 void
 iref(void)
@@ -1636,6 +1751,7 @@ main(int argc, char *argv[])
     twofiles();
     sharedfd();
     dirfile();
+    getdentstest();
     iref();
     forktest();
     bigdir(); // slow
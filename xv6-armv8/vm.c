@@ -26,10 +26,15 @@ struct {
     struct run *freelist;
 } kpt_mem;
 
+static void reclaim_init (void);
+static void reclaim_wait (pte_t *pte);
+
 void init_vmm (void)
 {
     initlock(&kpt_mem.lock, "vm");
     kpt_mem.freelist = NULL;
+
+    reclaim_init();
 }
 
 static void _kpt_free (char *v)
@@ -84,21 +89,28 @@ void* kpt_alloc (void)
     return (char*) r;
 }
 
-// Return the address of the PTE in page directory that corresponds to
-// virtual address va.  If alloc!=0, create any required page table pages.
-static pte_t* walkpgdir (pgd_t *pgdbase, const void *va, int alloc)
+// Return the leaf page table (the table of PTEs) that maps virtual
+// address va. If alloc!=0, create any required page table pages.
+// Otherwise, if there is no such table, return 0 and, if next is not
+// NULL, set *next to the first address past the hole: the end of the
+// missing PMD table, or of the whole PGD entry if that is empty too.
+static pte_t* walkleaf (pgd_t *pgdbase, uint64 va, int alloc, uint64 *next)
 {
     pgd_t *pgd;
     pmd_t *pmdbase;
     pmd_t *pmd;
     pte_t *ptebase;
 
-    pgd = &pgdbase[PGD_IDX((uint64)va)];
+    pgd = &pgdbase[PGD_IDX(va)];
 
     if(*pgd & (ENTRY_TABLE | ENTRY_VALID)) {
         pmdbase = (pmd_t*) p2v((*pgd) & PG_ADDR_MASK);
     } else {
         if (!alloc || (pmdbase = (pmd_t*) kpt_alloc()) == 0) {
+            if (next != NULL) {
+                *next = align_up(va + 1, PGD_SZ);
+            }
+
             return 0;
         }
 
@@ -113,7 +125,11 @@ static pte_t* walkpgdir (pgd_t *pgdbase, const void *va, int alloc)
         ptebase = (pte_t*) p2v((*pmd) & PG_ADDR_MASK);
     } else {
         if (!alloc || (ptebase = (pte_t*) kpt_alloc()) == 0) {
-           return 0;
+            if (next != NULL) {
+                *next = align_up(va + 1, PMD_SZ);
+            }
+
+            return 0;
         }
 
         // Make sure all those PTE_P bits are zero.
@@ -125,22 +141,86 @@ static pte_t* walkpgdir (pgd_t *pgdbase, const void *va, int alloc)
         *pmd = v2p(ptebase) | ENTRY_TABLE | ENTRY_VALID;
     }
 
+    return ptebase;
+}
+
+// Return the address of the PTE in page directory that corresponds to
+// virtual address va.  If alloc!=0, create any required page table pages.
+static pte_t* walkpgdir (pgd_t *pgdbase, const void *va, int alloc)
+{
+    pte_t *ptebase;
+
+    if ((ptebase = walkleaf(pgdbase, (uint64) va, alloc, NULL)) == 0) {
+        return 0;
+    }
+
     return &ptebase[PTE_IDX(va)];
 }
 
+// A cursor over the PTEs of the pages in [start, end). It keeps the
+// leaf table of the current page, so stepping to the next page is an
+// array increment; the page table is walked from the root only when
+// the cursor crosses into the range of another leaf table.
+struct ptwalk {
+    pgd_t   *pgdir;
+    uint64  va;     // page of the PTE last returned
+    uint64  next;   // next page to visit
+    uint64  end;
+    int     alloc;  // create missing page tables
+    pte_t   *leaf;  // leaf table that maps va
+};
+
+static void ptwalk_init (struct ptwalk *w, pgd_t *pgdir, uint64 start, uint64 end, int alloc)
+{
+    w->pgdir = pgdir;
+    w->va = 0;
+    w->next = align_dn(start, PTE_SZ);
+    w->end = end;
+    w->alloc = alloc;
+    w->leaf = 0;
+}
+
+// Return the PTE of the next page of the range, or 0 at the end of the
+// range. Without alloc, pages that have no page table are skipped, a
+// whole PMD or PGD entry at a time. With alloc, 0 before the end of the
+// range means a page table could not be allocated.
+static pte_t* ptwalk_next (struct ptwalk *w)
+{
+    while (w->next < w->end) {
+        w->va = w->next;
+        w->next += PTE_SZ;
+
+        if ((w->leaf == 0) || (PTE_IDX(w->va) == 0)) {
+            if ((w->leaf = walkleaf(w->pgdir, w->va, w->alloc, &w->next)) == 0) {
+                if (w->alloc) {
+                    return 0;
+                }
+
+                continue;
+            }
+        }
+
+        return &w->leaf[PTE_IDX(w->va)];
+    }
+
+    return 0;
+}
+
+// attributes of a present user/kernel page, except for the AP bits
+#define PTE_ATTR    (ACCESS_FLAG | SH_IN_SH | NON_SECURE_PA | MEM_ATTR_IDX_4 | ENTRY_PAGE | ENTRY_VALID)
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
 static int mappages (pgd_t *pgdir, void *va, uint size, uint pa, uint64 ap)
 {
-    char *a, *last;
+    struct ptwalk w;
     pte_t *pte;
 
-    a = (char*) align_dn(va, PTE_SZ);
-    last = (char*) align_dn((uint64)va + size - 1, PTE_SZ);
+    ptwalk_init(&w, pgdir, (uint64) va, (uint64) va + size, 1);
 
-    for (;;) {
-        if ((pte = walkpgdir(pgdir, a, 1)) == 0) {
+    while (w.next < w.end) {
+        if ((pte = ptwalk_next(&w)) == 0) {
             return -1;
         }
 
@@ -148,15 +228,10 @@ static int mappages (pgd_t *pgdir, void *va, uint size, uint pa, uint64 ap)
             panic("remap");
         }
 
-        *pte = pa | ACCESS_FLAG | SH_IN_SH | ap | NON_SECURE_PA | MEM_ATTR_IDX_4 | ENTRY_PAGE | ENTRY_VALID;
-
-        if (a == last) {
-            break;
-        }
-
-        a += PTE_SZ;
+        *pte = pa | ap | PTE_ATTR;
         pa += PTE_SZ;
     }
+
     return 0;
 }
 
@@ -166,6 +241,32 @@ static void flush_tlb (void)
     asm("TLBI VMALLE1" : : :);
 }
 
+// flush the TLB entry for one page of the current user address space
+static void flush_tlb_page (uint64 va)
+{
+    va = va >> PTE_SHIFT;
+
+    asm("DSB ISHST" : : :);
+    asm("TLBI VAAE1, %[v]" : :[v]"r" (va):);
+    asm("DSB ISH" : : :);
+    asm("ISB" : : :);
+}
+
+// Allocate a page for user memory. If the allocator runs out of
+// pages, swap out a user page and try again.
+static char* alloc_upage (void)
+{
+    char *mem;
+
+    while ((mem = alloc_page()) == 0) {
+        if (reclaim_page() < 0) {
+            return 0;
+        }
+    }
+
+    return mem;
+}
+
 // Switch to the user page table (TTBR0)
 void switchuvm (struct proc *p)
 {
@@ -194,7 +295,7 @@ void inituvm (pgd_t *pgdir, char *init, uint sz)
         panic("inituvm: more than a page");
     }
 
-    mem = alloc_page();
+    mem = alloc_upage();
     memset(mem, 0, PTE_SZ);
     mappages(pgdir, 0, PTE_SZ, v2p(mem), AP_RW_1_0);
     memmove(mem, init, sz);
@@ -204,6 +305,7 @@ void inituvm (pgd_t *pgdir, char *init, uint sz)
 // and the pages from addr to addr+sz must already be mapped.
 int loaduvm (pgd_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
 {
+    struct ptwalk w;
     uint i, pa, n;
     pte_t *pte;
 
@@ -211,8 +313,10 @@ int loaduvm (pgd_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
         panic("loaduvm: addr must be page aligned");
     }
 
+    ptwalk_init(&w, pgdir, (uint64) addr, (uint64) addr + sz, 0);
+
     for (i = 0; i < sz; i += PTE_SZ) {
-        if ((pte = walkpgdir(pgdir, addr + i, 0)) == 0) {
+        if (((pte = ptwalk_next(&w)) == 0) || (w.va != (uint64) addr + i)) {
             panic("loaduvm: address should exist");
         }
 
@@ -236,6 +340,8 @@ int loaduvm (pgd_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 int allocuvm (pgd_t *pgdir, uint oldsz, uint newsz)
 {
+    struct ptwalk w;
+    pte_t *pte;
     char *mem;
     uint64 a;
 
@@ -248,18 +354,27 @@ int allocuvm (pgd_t *pgdir, uint oldsz, uint newsz)
     }
 
     a = align_up(oldsz, PTE_SZ);
+    ptwalk_init(&w, pgdir, a, newsz, 1);
 
     for (; a < newsz; a += PTE_SZ) {
-        mem = alloc_page();
+        mem = alloc_upage();
+
+        if ((mem == 0) || ((pte = ptwalk_next(&w)) == 0)) {
+            if (mem != 0) {
+                free_page(mem);
+            }
 
-        if (mem == 0) {
             cprintf("allocuvm out of memory\n");
             deallocuvm(pgdir, newsz, oldsz);
             return 0;
         }
 
+        if (*pte & (ENTRY_PAGE | ENTRY_VALID)) {
+            panic("remap");
+        }
+
         memset(mem, 0, PTE_SZ);
-        mappages(pgdir, (char*) a, PTE_SZ, v2p(mem), AP_RW_1_0);
+        *pte = v2p(mem) | AP_RW_1_0 | PTE_ATTR;
     }
 
     return newsz;
@@ -271,21 +386,25 @@ int allocuvm (pgd_t *pgdir, uint oldsz, uint newsz)
 // process size.  Returns the new process size.
 int deallocuvm (pgd_t *pgdir, uint oldsz, uint newsz)
 {
+    struct ptwalk w;
     pte_t *pte;
-    uint64 a;
     uint pa;
 
     if (newsz >= oldsz) {
         return oldsz;
     }
 
-    for (a = align_up(newsz, PTE_SZ); a < oldsz; a += PTE_SZ) {
-        pte = walkpgdir(pgdir, (char*) a, 0);
+    // the walk skips the parts of the range without page tables
+    ptwalk_init(&w, pgdir, align_up(newsz, PTE_SZ), oldsz, 0);
 
-        if (!pte) {
-            // pte == 0 --> no page table for this entry
-            // round it up to the next page directory
-            a = align_up (a, PMD_SZ);
+    while ((pte = ptwalk_next(&w)) != 0) {
+        if (*pte & PTE_BUSY) {
+            reclaim_wait(pte);
+        }
+
+        if (*pte & PTE_SWAP) {
+            swap_free(PTE_SLOT(*pte));
+            *pte = 0;
 
         } else if ((*pte & (ENTRY_PAGE | ENTRY_VALID)) != 0) {
             pa = PTE_ADDR(*pte);
@@ -354,8 +473,9 @@ void clearpteu (pgd_t *pgdir, char *uva)
 // of it for a child.
 pgd_t* copyuvm (pgd_t *pgdir, uint sz)
 {
+    struct ptwalk from, to;
     pgd_t *d;
-    pte_t *pte;
+    pte_t *pte, *npte;
     uint64 pa, i, ap;
     char *mem;
 
@@ -365,28 +485,45 @@ pgd_t* copyuvm (pgd_t *pgdir, uint sz)
         return NULL ;
     }
 
+    ptwalk_init(&from, pgdir, 0, sz, 0);
+    ptwalk_init(&to, d, 0, sz, 1);
+
     // copy the whole address space over (no COW)
     for (i = 0; i < sz; i += PTE_SZ) {
-        if ((pte = walkpgdir(pgdir, (void *) i, 0)) == 0) {
+        // allocate before looking at the parent's PTE: reclaiming
+        // memory may swap out pages of the parent.
+        if ((mem = alloc_upage()) == 0) {
+            goto bad;
+        }
+
+        if (((pte = ptwalk_next(&from)) == 0) || (from.va != i)) {
             panic("copyuvm: pte should exist");
         }
 
-        if (!(*pte & (ENTRY_PAGE | ENTRY_VALID))) {
-            panic("copyuvm: page not present");
+        if (*pte & PTE_BUSY) {
+            reclaim_wait(pte);
         }
 
-        pa = PTE_ADDR (*pte);
         ap = PTE_AP (*pte);
 
-        if ((mem = alloc_page()) == 0) {
-            goto bad;
-        }
+        if (*pte & PTE_SWAP) {
+            // the child gets its own copy, read from the parent's slot
+            swap_read(PTE_SLOT(*pte), mem);
+
+        } else if (!(*pte & (ENTRY_PAGE | ENTRY_VALID))) {
+            panic("copyuvm: page not present");
 
-        memmove(mem, (char*) p2v(pa), PTE_SZ);
+        } else {
+            pa = PTE_ADDR (*pte);
+            memmove(mem, (char*) p2v(pa), PTE_SZ);
+        }
 
-        if (mappages(d, (void*) i, PTE_SZ, v2p(mem), ap) < 0) {
+        if ((npte = ptwalk_next(&to)) == 0) {
+            free_page(mem);
             goto bad;
         }
+
+        *npte = v2p(mem) | ap | PTE_ATTR;
     }
     return d;
 
@@ -402,6 +539,15 @@ char* uva2ka (pgd_t *pgdir, char *uva)
 
     pte = walkpgdir(pgdir, uva, 0);
 
+    if (pte == 0) {
+        return 0;
+    }
+
+    // bring the page back if it has been swapped out
+    if ((*pte & PTE_SWAP) && (pgfault(pgdir, (uint64)uva) < 0)) {
+        return 0;
+    }
+
     // make sure it exists
     if ((*pte & (ENTRY_PAGE | ENTRY_VALID)) == 0) {
         return 0;
@@ -412,17 +558,29 @@ char* uva2ka (pgd_t *pgdir, char *uva)
         return 0;
     }
 
+    // the page is being used, let the reclaimer know
+    *pte |= ACCESS_FLAG;
+
     return (char*) p2v(PTE_ADDR(*pte));
 }
 
 // Copy len bytes from p to user address va in page table pgdir.
-// Most useful when pgdir is not the current page table.
-// uva2ka ensures this only works for user pages.
+// If pgdir is the current page table, the copy goes through the user
+// mapping (see usercopy.S). Otherwise, uva2ka looks up each page; this
+// ensures it only works for user pages.
 int copyout (pgd_t *pgdir, uint va, void *p, uint len)
 {
     char *buf, *pa0;
     uint64 n, va0;
 
+    if ((proc != NULL) && (pgdir == proc->pgdir)) {
+        if ((va >= proc->sz) || (len > proc->sz - va)) {
+            return -1;
+        }
+
+        return user_copyout(va, p, len);
+    }
+
     buf = (char*) p;
 
     while (len > 0) {
@@ -449,6 +607,270 @@ int copyout (pgd_t *pgdir, uint va, void *p, uint len)
     return 0;
 }
 
+// Copy len bytes from user address va of the current process to dst.
+int copyin (void *dst, uint64 va, uint len)
+{
+    if ((va >= proc->sz) || (len > proc->sz - va)) {
+        return -1;
+    }
+
+    return user_copyin(dst, va, len);
+}
+
+// Copy a nul-terminated string from user address va of the current
+// process to dst, which holds max bytes. Return the length of the
+// string, not including the nul, or -1 on error.
+int copyinstr (char *dst, uint64 va, uint max)
+{
+    if (va >= proc->sz) {
+        return -1;
+    }
+
+    if (max > proc->sz - va) {
+        max = proc->sz - va;
+    }
+
+    return user_copyinstr(dst, va, max);
+}
+
+//PAGEBREAK!
+// Page reclaim. User pages are aged by a clock whose hand sweeps the
+// address spaces of all the processes in turn. When the hand passes a
+// page, its access flag is cleared; the next access to the page takes
+// an access flag fault which sets it again (see pgfault). A page whose
+// flag is still clear when the hand comes back has not been used for a
+// whole sweep, it is written to swap and its memory is freed.
+//
+// The page is unmapped before it is written, with PTE_BUSY set along
+// with PTE_SWAP, so that its owner can't change it meanwhile: anyone
+// that finds the PTE busy waits for the write to end (reclaim_wait).
+// This also keeps the PTE and the page table it is in from being
+// freed under the reclaimer. One page is written at a time; hand.lock
+// protects the hand and the busy PTEs.
+static struct {
+    struct spinlock lock;
+    int     busy;   // a page is being written to swap
+    int     slot;   // process table slot under the hand
+    uint64  va;     // next user address to look at
+} hand;
+
+static void reclaim_init (void)
+{
+    initlock(&hand.lock, "reclaim");
+}
+
+// Wait for a page being written to swap to get there.
+static void reclaim_wait (pte_t *pte)
+{
+    acquire(&hand.lock);
+
+    while (*pte & PTE_BUSY) {
+        sleep(&hand, &hand.lock);
+    }
+
+    release(&hand.lock);
+}
+
+// Swap out one user page. Return 0 on success, -1 if no page
+// could be reclaimed (nothing to evict or swap space is full, or
+// the caller holds a spinlock and can't wait for the disk).
+int reclaim_page (void)
+{
+    struct proc *p;
+    pte_t *pte;
+    uint64 va, pa;
+    int n, slot;
+
+    if (cpu->ncli > 0) {
+        return -1;
+    }
+
+    acquire(&hand.lock);
+
+    // someone else is writing a page: wait for it, its
+    // memory is free when it is done
+    if (hand.busy) {
+        while (hand.busy) {
+            sleep(&hand, &hand.lock);
+        }
+
+        release(&hand.lock);
+        return 0;
+    }
+
+    // visit each address space at most twice: the first pass
+    // over a page may only clear its access flag.
+    for (n = 0; n <= 2 * NPROC; n++) {
+        p = procslot(hand.slot);
+
+        if ((p->pgdir != 0) &&
+            ((p->state == RUNNABLE) || (p->state == RUNNING) || (p->state == SLEEPING))) {
+
+            while (hand.va < p->sz) {
+                va = hand.va;
+
+                if ((pte = walkpgdir(p->pgdir, (void*) va, 0)) == 0) {
+                    // no page table here, skip to the next one
+                    hand.va = align_up(va + 1, PMD_SZ);
+                    continue;
+                }
+
+                hand.va += PTE_SZ;
+
+                // skip pages not in memory, and the stack guard page
+                if (!(*pte & ENTRY_VALID) || (PTE_AP(*pte) != AP_RW_1_0)) {
+                    continue;
+                }
+
+                if (*pte & ACCESS_FLAG) {
+                    // recently used, give it a second chance
+                    *pte &= ~ACCESS_FLAG;
+                    flush_tlb_page(va);
+                    continue;
+                }
+
+                if ((slot = swap_alloc()) < 0) {
+                    release(&hand.lock);
+                    return -1;
+                }
+
+                pa = PTE_ADDR(*pte);
+
+                *pte = PTE_SWAP | PTE_BUSY | ((uint64) slot << PTE_SHIFT) | PTE_AP(*pte);
+                flush_tlb_page(va);
+
+                hand.busy = 1;
+                release(&hand.lock);
+
+                swap_write(slot, p2v(pa));
+
+                acquire(&hand.lock);
+                *pte &= ~PTE_BUSY;
+                free_page(p2v(pa));
+                hand.busy = 0;
+                wakeup(&hand);
+                release(&hand.lock);
+
+                return 0;
+            }
+        }
+
+        hand.slot = (hand.slot + 1) % NPROC;
+        hand.va = 0;
+    }
+
+    release(&hand.lock);
+    return -1;
+}
+
+// Handle a fault on user address va in pgdir. A page aged by the
+// reclaimer only needs its access flag set again, a swapped-out
+// page is read back from swap. Return -1 if the fault is not caused
+// by the reclaimer (a genuine fault).
+int pgfault (pgd_t *pgdir, uint64 va)
+{
+    pte_t *pte;
+    char *mem;
+    uint slot;
+
+    if ((pgdir == 0) || (va >= UADDR_SZ) || ((pte = walkpgdir(pgdir, (void*) va, 0)) == 0)) {
+        return -1;
+    }
+
+    if (*pte & ENTRY_VALID) {
+        if (*pte & ACCESS_FLAG) {
+            return -1;
+        }
+
+        *pte |= ACCESS_FLAG;
+        flush_tlb_page(va);
+        return 0;
+    }
+
+    if (!(*pte & PTE_SWAP)) {
+        return -1;
+    }
+
+    // Reading the page back sleeps. The kernel touches user memory
+    // with no spinlock held (see piperead); fail if it did anyway.
+    if (cpu->ncli > 0) {
+        cprintf("pgfault: swap-in with a spinlock held\n");
+        return -1;
+    }
+
+    if (*pte & PTE_BUSY) {
+        reclaim_wait(pte);
+    }
+
+    if ((mem = alloc_upage()) == 0) {
+        cprintf("pgfault: out of memory\n");
+        return -1;
+    }
+
+    slot = PTE_SLOT(*pte);
+    swap_read(slot, mem);
+    swap_free(slot);
+
+    *pte = v2p(mem) | PTE_AP(*pte) | PTE_ATTR;
+    flush_tlb_page(va);
+
+    return 0;
+}
+
+// Compaction support: count the user pages whose physical address lies
+// in [lo, hi). If held is not NULL, also migrate each of them to a new
+// page outside of the range and rewrite its PTE (see kmem_compact).
+// Returns the number of pages found, or -1 if migration ran out of memory.
+int move_upages (uint64 lo, uint64 hi, void **held)
+{
+    struct ptwalk w;
+    struct proc *p;
+    pte_t *pte;
+    uint64 pa;
+    char *mem;
+    int i, n;
+
+    n = 0;
+
+    for (i = 0; i < NPROC; i++) {
+        p = procslot(i);
+
+        if ((p->pgdir == 0) || (p->state == UNUSED) || (p->state == EMBRYO)) {
+            continue;
+        }
+
+        ptwalk_init(&w, p->pgdir, 0, p->sz, 0);
+
+        while ((pte = ptwalk_next(&w)) != 0) {
+            if (!(*pte & ENTRY_VALID)) {
+                continue;
+            }
+
+            pa = PTE_ADDR(*pte);
+
+            if ((pa < lo) || (pa >= hi)) {
+                continue;
+            }
+
+            n++;
+
+            if (held == NULL) {
+                continue;
+            }
+
+            if ((mem = alloc_page_outside(P2V_WO(lo), P2V_WO(hi), held)) == 0) {
+                return -1;
+            }
+
+            memmove(mem, p2v(pa), PTE_SZ);
+            *pte = (*pte & ~(uint64)PG_ADDR_MASK) | v2p(mem);
+            flush_tlb_page(w.va);
+            free_page(p2v(pa));
+        }
+    }
+
+    return n;
+}
 
 // 1:1 map the memory [phy_low, phy_hi] in kernel. We need to
 // use 2-level mapping for this block of memory. The rumor has